@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "aio.h"
+
+// moves len bytes at offset off with pread / pwrite, finishing short transfers
+int
+full_transfer(int fd, bool write, uint8_t *buf, size_t len, off_t off)
+{
+    while (len > 0) {
+        ssize_t n = write ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            // reading past the end of the image gives zeros
+            if (write)
+                return -1;
+            memset(buf, 0, len);
+            return 0;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+AsyncEngine::AsyncEngine(unsigned depth)
+{
+    const char *env = getenv("FS_AIO_DEPTH");
+    if (env != nullptr && atoi(env) > 0)
+        depth = (unsigned)atoi(env);
+    this->depth = std::max(depth, 1u);
+
+    env = getenv("FS_AIO_ENGINE");
+    bool threads_only = (env != nullptr && std::string(env) == "threads");
+    if (threads_only || !setup_uring()) {
+        unsigned n = std::min(this->depth, 4u);
+        for (unsigned i = 0; i < n; i++)
+            workers.emplace_back(&AsyncEngine::worker, this);
+    }
+}
+
+AsyncEngine::~AsyncEngine()
+{
+    if (ring_fd >= 0) {
+        while (in_flight > 0)
+            reap_uring(1);
+        teardown_uring();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    for (auto &t : workers)
+        t.join();
+}
+
+bool
+AsyncEngine::setup_uring()
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if (fd < 0)
+        return false;
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        close(fd);
+        return false;
+    }
+    if (single_mmap) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+            sq_ring = cq_ring = nullptr;
+            close(fd);
+            return false;
+        }
+    }
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+    if (s == MAP_FAILED) {
+        munmap(sq_ring, sq_ring_size);
+        if (cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        sq_ring = cq_ring = nullptr;
+        close(fd);
+        return false;
+    }
+    sqes = (struct io_uring_sqe*)s;
+
+    char *sq = (char*)sq_ring;
+    char *cq = (char*)cq_ring;
+    sq_head = (unsigned*)(sq + p.sq_off.head);
+    sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + p.sq_off.array);
+    cq_head = (unsigned*)(cq + p.cq_off.head);
+    cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    slots.resize(depth);
+    ring_fd = fd;
+    return true;
+}
+
+void
+AsyncEngine::teardown_uring()
+{
+    munmap(sqes, sqes_size);
+    if (cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+    ring_fd = -1;
+}
+
+// moves finished io_uring requests to done, waiting for at least
+// min_complete of them
+int
+AsyncEngine::reap_uring(unsigned min_complete)
+{
+    unsigned reaped = 0;
+    while (true) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            uring_slot &slot = slots[cqe->user_data];
+            int res = cqe->res;
+            head++;
+
+            int result = 0;
+            if (res < 0) {
+                result = -1;
+            } else if ((size_t)res < slot.req.len) {
+                // finish a short transfer synchronously
+                const aio_request &r = slot.req;
+                result = full_transfer(r.fd, r.write, r.buf + res, r.len - res, r.offset + res);
+            }
+            done.push_back({slot.req.tag, result});
+            slot.used = false;
+            in_flight--;
+            reaped++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        if (reaped >= min_complete || in_flight == 0)
+            return 0;
+        int r = (int)syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (r < 0 && errno != EINTR)
+            return -1;
+    }
+}
+
+void
+AsyncEngine::worker()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        queue_cv.wait(guard, [this] { return stopping || !queue.empty(); });
+        if (queue.empty())
+            return;
+        aio_request req = queue.front();
+        queue.pop_front();
+        guard.unlock();
+        int result = full_transfer(req.fd, req.write, req.buf, req.len, req.offset);
+        guard.lock();
+        done.push_back({req.tag, result});
+        in_flight--;
+        done_cv.notify_all();
+    }
+}
+
+// queues a request, waiting for a free slot if depth requests are in flight
+int
+AsyncEngine::submit(const aio_request &req)
+{
+    if (ring_fd < 0) {
+        std::unique_lock<std::mutex> guard(lock);
+        done_cv.wait(guard, [this] { return in_flight < depth; });
+        queue.push_back(req);
+        in_flight++;
+        queue_cv.notify_one();
+        return 0;
+    }
+
+    while (in_flight >= depth) {
+        if (reap_uring(1) != 0)
+            return -1;
+    }
+    unsigned idx = 0;
+    while (slots[idx].used)
+        idx++;
+    uring_slot &slot = slots[idx];
+    slot.req = req;
+    slot.iov.iov_base = req.buf;
+    slot.iov.iov_len = req.len;
+    slot.used = true;
+
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req.write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = req.fd;
+    sqe->addr = (uint64_t)(uintptr_t)&slot.iov;
+    sqe->len = 1;
+    sqe->off = (uint64_t)req.offset;
+    sqe->user_data = idx;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    in_flight++;
+
+    while (true) {
+        int r = (int)syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0);
+        if (r >= 0)
+            return 0;
+        if (errno == EAGAIN || errno == EBUSY) {
+            // the completion queue is full, make room and try again
+            reap_uring(0);
+        } else if (errno != EINTR) {
+            // the kernel did not take the entry, so its slot and its share
+            // of the depth are free again
+            if (__atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == tail) {
+                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+                slot.used = false;
+                in_flight--;
+                done_cv.notify_all();
+            }
+            return -1;
+        }
+    }
+}
+
+// hands out finished requests without blocking, returns how many
+unsigned
+AsyncEngine::poll(std::vector<aio_completion> &out)
+{
+    if (ring_fd >= 0)
+        reap_uring(0);
+    std::lock_guard<std::mutex> guard(lock);
+    unsigned n = done.size();
+    out.insert(out.end(), done.begin(), done.end());
+    done.clear();
+    return n;
+}
+
+// hands out finished requests, blocking until at least min_complete are available
+unsigned
+AsyncEngine::wait(std::vector<aio_completion> &out, unsigned min_complete)
+{
+    if (ring_fd >= 0) {
+        while (done.size() < min_complete && in_flight > 0) {
+            if (reap_uring(1) != 0)
+                break;
+        }
+        return poll(out);
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    done_cv.wait(guard, [this, min_complete] {
+        return done.size() >= std::min<size_t>(min_complete, done.size() + in_flight);
+    });
+    unsigned n = done.size();
+    out.insert(out.end(), done.begin(), done.end());
+    done.clear();
+    return n;
+}
@@ -0,0 +1,92 @@
+// aio.h is the header file for the AsyncEngine class, which keeps several
+// block transfers in flight at once for the Disk.
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifndef __AIO_H__
+#define __AIO_H__
+
+// default queue depth, can be overridden with FS_AIO_DEPTH
+#define AIO_QUEUE_DEPTH 32
+
+struct aio_request {
+    int fd;
+    bool write;
+    uint8_t *buf;
+    size_t len;
+    off_t offset;
+    uint64_t tag; // returned unchanged in the completion
+};
+
+struct aio_completion {
+    uint64_t tag;
+    int result; // 0 if all len bytes were transferred, -1 otherwise
+};
+
+// moves len bytes at offset off with pread / pwrite, finishing short
+// transfers. Reading past the end of the file gives zeros.
+int full_transfer(int fd, bool write, uint8_t *buf, size_t len, off_t off);
+
+// Requests are executed by io_uring when the kernel allows it, otherwise by
+// a small pool of worker threads doing pread / pwrite. FS_AIO_ENGINE=threads
+// forces the thread pool.
+class AsyncEngine {
+private:
+    unsigned depth;
+    unsigned in_flight = 0;
+    // completions that were reaped internally but not handed out yet
+    std::vector<aio_completion> done;
+
+    // io_uring state
+    int ring_fd = -1;
+    void *sq_ring = nullptr;
+    void *cq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    // one slot per request in flight, the slot index is the sqe user_data
+    struct uring_slot {
+        aio_request req;
+        struct iovec iov;
+        bool used = false;
+    };
+    std::vector<uring_slot> slots;
+
+    // thread pool state
+    std::vector<std::thread> workers;
+    std::deque<aio_request> queue;
+    std::mutex lock;
+    std::condition_variable queue_cv;
+    std::condition_variable done_cv;
+    bool stopping = false;
+
+    bool setup_uring();
+    void teardown_uring();
+    // moves finished io_uring requests to done, waiting for at least
+    // min_complete of them
+    int reap_uring(unsigned min_complete);
+    void worker();
+
+public:
+    AsyncEngine(unsigned depth = AIO_QUEUE_DEPTH);
+    ~AsyncEngine();
+    // queues a request, waiting for a free slot if depth requests are in flight
+    int submit(const aio_request &req);
+    // hands out finished requests without blocking, returns how many
+    unsigned poll(std::vector<aio_completion> &out);
+    // hands out finished requests, blocking until at least min_complete
+    // (bounded by the number in flight) are available
+    unsigned wait(std::vector<aio_completion> &out, unsigned min_complete = 1);
+};
+
+#endif // __AIO_H__
@@ -0,0 +1,617 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include "cache.h"
+
+BlockCache::BlockCache(Disk &disk, uint64_t budget) : disk(disk), budget(budget)
+{
+    configure();
+}
+
+void
+BlockCache::configure()
+{
+    const char *env = getenv("FS_CACHE_BLOCKS");
+    unsigned capacity = budget / disk.get_block_size();
+    if (env != nullptr && atoi(env) > 0)
+        capacity = (unsigned)atoi(env);
+    if (capacity < 4)
+        capacity = 4;
+    this->capacity = capacity;
+    // the usual 2Q tuning: a quarter of the budget for first references and
+    // ghost entries for half of the budget
+    this->a1in_max = capacity / 4;
+    this->a1out_max = capacity / 2;
+    buffers.set_size(disk.get_block_size());
+}
+
+BlockCache::~BlockCache()
+{
+    sync();
+}
+
+void
+BlockCache::remember(unsigned block_no)
+{
+    a1out.push_front(block_no);
+    ghosts[block_no] = a1out.begin();
+    if (a1out.size() > a1out_max) {
+        ghosts.erase(a1out.back());
+        a1out.pop_back();
+    }
+}
+
+int
+BlockCache::evict()
+{
+    if (entries.empty())
+        return 0;
+    bool from_a1in = !a1in.empty() && (a1in.size() > a1in_max || am.empty());
+    std::list<unsigned> *queues[2] = { from_a1in ? &a1in : &am, from_a1in ? &am : &a1in };
+
+    // the oldest block that is not pinned, see the class comment
+    std::list<unsigned> *queue = nullptr;
+    std::list<unsigned>::iterator pos;
+    for (std::list<unsigned> *q : queues) {
+        for (auto it = q->rbegin(); it != q->rend() && queue == nullptr; ++it) {
+            cache_entry &e = entries[*it];
+            if (!journaled || !e.dirty || e.logged) {
+                queue = q;
+                pos = std::prev(it.base());
+            }
+        }
+    }
+    if (queue == nullptr)
+        return 1;
+
+    unsigned victim = *pos;
+    cache_entry &e = entries[victim];
+    if (e.dirty) {
+        if (disk.write(victim, e.data.get()) != 0)
+            return -1;
+        unflushed = true;
+        stats.writebacks++;
+    }
+    stats.evictions++;
+
+    queue->erase(pos);
+    if (queue == &a1in)
+        remember(victim);
+    buffers.put(std::move(e.data));
+    entries.erase(victim);
+    return 0;
+}
+
+// notes the logged blocks among count blocks that are overwritten in place
+// or discarded
+void
+BlockCache::overwritten(unsigned block_no, unsigned count)
+{
+    for (unsigned i = 0; i < count && !in_log.empty(); i++) {
+        if (in_log.erase(block_no + i) != 0)
+            revoked.push_back(block_no + i);
+    }
+}
+
+// counts a write to each of count blocks that a miss is reading
+void
+BlockCache::written(unsigned block_no, unsigned count)
+{
+    for (unsigned i = 0; i < count && !loads.empty(); i++) {
+        auto it = loads.find(block_no + i);
+        if (it != loads.end())
+            it->second.writes++;
+    }
+}
+
+// the newest queued write run covering the block holds its contents until
+// the write has finished
+bool
+BlockCache::queued_contents(unsigned block_no, uint8_t *blk)
+{
+    for (auto r = pending.rbegin(); r != pending.rend(); ++r) {
+        if (r->write && block_no >= r->block_no && block_no < r->block_no + r->count) {
+            memcpy(blk, r->buf + (size_t)(block_no - r->block_no) * disk.get_block_size(), disk.get_block_size());
+            return true;
+        }
+    }
+    return false;
+}
+
+BlockCache::cache_entry *
+BlockCache::lookup(unsigned block_no, bool load)
+{
+    auto it = entries.find(block_no);
+    if (it != entries.end()) {
+        cache_entry &e = it->second;
+        // hits in a1in are not promoted, that is what keeps scans out of am
+        if (e.hot) {
+            am.splice(am.begin(), am, e.pos);
+        }
+        stats.hits++;
+        return &e;
+    }
+    stats.misses++;
+
+    if (block_no >= disk.get_no_blocks()) {
+        std::cout << "BlockCache - ERROR: Invalid block number (" << block_no << ")\n";
+        return nullptr;
+    }
+
+    while (entries.size() >= capacity) {
+        int ret = evict();
+        if (ret < 0)
+            return nullptr;
+        if (ret > 0) // everything is pinned
+            break;
+    }
+
+    cache_entry &e = entries[block_no];
+    e.data = buffers.get();
+    if (load && disk.read(block_no, e.data.get()) != 0) {
+        buffers.put(std::move(e.data));
+        entries.erase(block_no);
+        return nullptr;
+    }
+
+    auto ghost = ghosts.find(block_no);
+    if (ghost != ghosts.end()) {
+        // referenced again shortly after leaving a1in, so it is hot
+        a1out.erase(ghost->second);
+        ghosts.erase(ghost);
+        e.hot = true;
+        am.push_front(block_no);
+        e.pos = am.begin();
+    } else {
+        a1in.push_front(block_no);
+        e.pos = a1in.begin();
+    }
+    return &e;
+}
+
+// reads one block, from memory if cached. A miss is read from the disk
+// outside the lock and then added, unless another thread added it first.
+// If the block was written meanwhile the disk copy may be stale, and the
+// miss starts over.
+int
+BlockCache::read(unsigned block_no, uint8_t *blk)
+{
+    for (;;) {
+        uint64_t writes;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = entries.find(block_no);
+            if (it != entries.end() || block_no >= disk.get_no_blocks()) {
+                cache_entry *e = lookup(block_no, true);
+                if (e == nullptr)
+                    return -1;
+                memcpy(blk, e->data.get(), disk.get_block_size());
+                return 0;
+            }
+            if (queued_contents(block_no, blk))
+                return 0;
+            load_state &l = loads[block_no];
+            l.readers++;
+            writes = l.writes;
+        }
+        int ret = disk.read(block_no, blk);
+        std::lock_guard<std::mutex> guard(lock);
+        load_state &l = loads[block_no];
+        bool stale = l.writes != writes;
+        if (--l.readers == 0)
+            loads.erase(block_no);
+        if (ret != 0)
+            return -1;
+        bool added = entries.count(block_no) != 0;
+        if (stale && !added)
+            continue;
+        cache_entry *e = lookup(block_no, false);
+        if (e == nullptr)
+            return -1;
+        if (added)
+            memcpy(blk, e->data.get(), disk.get_block_size());
+        else
+            memcpy(e->data.get(), blk, disk.get_block_size());
+        return 0;
+    }
+}
+
+// writes one block into the cache, it reaches the disk on eviction or sync
+int
+BlockCache::write(unsigned block_no, uint8_t *blk)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    // the whole block is overwritten, so a miss does not need a disk read
+    cache_entry *e = lookup(block_no, false);
+    if (e == nullptr)
+        return -1;
+    memcpy(e->data.get(), blk, disk.get_block_size());
+    e->dirty = true;
+    e->logged = false;
+    written(block_no, 1);
+    return 0;
+}
+
+// copies the dirty cached blocks among count blocks, called with the lock
+// held
+BlockCache::dirty_copies
+BlockCache::copy_dirty(unsigned block_no, unsigned count)
+{
+    size_t size = disk.get_block_size();
+    dirty_copies dirty;
+    for (unsigned i = 0; i < count && !entries.empty(); i++) {
+        auto it = entries.find(block_no + i);
+        if (it != entries.end() && it->second.dirty) {
+            dirty.blocks.push_back(block_no + i);
+            dirty.data.insert(dirty.data.end(), it->second.data.get(), it->second.data.get() + size);
+        }
+    }
+    return dirty;
+}
+
+// cached copies may be newer than the disk, and a dirty block evicted since
+// the copies were taken is newer there too. Called with the lock held.
+void
+BlockCache::overlay(unsigned block_no, unsigned count, uint8_t *buf, const dirty_copies &dirty)
+{
+    size_t size = disk.get_block_size();
+    size_t k = 0;
+    for (unsigned i = 0; i < count; i++) {
+        auto it = entries.find(block_no + i);
+        bool copied = k < dirty.blocks.size() && dirty.blocks[k] == block_no + i;
+        if (it != entries.end())
+            memcpy(buf + i * size, it->second.data.get(), size);
+        else if (copied)
+            memcpy(buf + i * size, dirty.data.data() + k * size, size);
+        k += copied ? 1 : 0;
+    }
+}
+
+// reads count consecutive blocks with a single disk call, unless all of
+// them are cached
+int
+BlockCache::read_run(unsigned block_no, unsigned count, uint8_t *buf)
+{
+    dirty_copies dirty;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        bool all_cached = true;
+        for (unsigned i = 0; i < count && all_cached; i++)
+            all_cached = entries.count(block_no + i) != 0;
+        if (all_cached) {
+            overlay(block_no, count, buf, dirty);
+            return 0;
+        }
+        dirty = copy_dirty(block_no, count);
+    }
+    if (disk.read_blocks(block_no, count, buf) != 0)
+        return -1;
+    std::lock_guard<std::mutex> guard(lock);
+    overlay(block_no, count, buf, dirty);
+    return 0;
+}
+
+// writes count consecutive blocks with a single disk call. Cached copies
+// take the new contents first, so an eviction of an older copy while the
+// write runs can not land after it.
+int
+BlockCache::write_run(unsigned block_no, unsigned count, uint8_t *buf)
+{
+    size_t size = disk.get_block_size();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (unsigned i = 0; i < count; i++) {
+            auto it = entries.find(block_no + i);
+            if (it != entries.end())
+                memcpy(it->second.data.get(), buf + i * size, size);
+        }
+        unflushed = true;
+        overwritten(block_no, count);
+        written(block_no, count);
+    }
+    if (disk.write_blocks(block_no, count, buf) != 0)
+        return -1;
+    // cached copies match the disk now, unless written again meanwhile
+    std::lock_guard<std::mutex> guard(lock);
+    for (unsigned i = 0; i < count; i++) {
+        auto it = entries.find(block_no + i);
+        if (it != entries.end() && memcmp(it->second.data.get(), buf + i * size, size) == 0)
+            it->second.dirty = false;
+    }
+    return 0;
+}
+
+// takes the asynchronous engine for this thread if no one else has runs
+// queued on it, called with the lock held
+bool
+BlockCache::own_engine()
+{
+    if (pending.empty())
+        aio_owner = std::this_thread::get_id();
+    return aio_owner == std::this_thread::get_id();
+}
+
+// queues a read of count consecutive blocks
+int
+BlockCache::submit_read_run(unsigned block_no, unsigned count, uint8_t *buf)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (!own_engine()) {
+        guard.unlock();
+        return read_run(block_no, count, buf);
+    }
+    pending.push_back({block_no, count, buf, false, copy_dirty(block_no, count)});
+    uint64_t tag = pending.size() - 1;
+    guard.unlock();
+    return disk.submit_read(block_no, count, buf, tag);
+}
+
+// queues a write of count consecutive blocks
+int
+BlockCache::submit_write_run(unsigned block_no, unsigned count, uint8_t *buf)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (!own_engine()) {
+        guard.unlock();
+        return write_run(block_no, count, buf);
+    }
+    // cached copies take the new contents now, wait_runs marks them clean
+    // once the write has finished
+    for (unsigned i = 0; i < count; i++) {
+        auto it = entries.find(block_no + i);
+        if (it != entries.end())
+            memcpy(it->second.data.get(), buf + (size_t)i * disk.get_block_size(), disk.get_block_size());
+    }
+    unflushed = true;
+    overwritten(block_no, count);
+    written(block_no, count);
+    pending.push_back({block_no, count, buf, true, {}});
+    uint64_t tag = pending.size() - 1;
+    guard.unlock();
+    return disk.submit_write(block_no, count, buf, tag);
+}
+
+// waits until every queued run of this thread has finished
+int
+BlockCache::wait_runs()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (pending.empty() || aio_owner != std::this_thread::get_id())
+            return 0;
+    }
+    int ret = 0;
+    std::vector<aio_completion> done;
+    size_t finished = 0;
+    while (finished < pending.size()) {
+        done.clear();
+        unsigned n = disk.wait(done, 1);
+        if (n == 0) {
+            // nothing left in flight, a submit must have failed
+            ret = -1;
+            break;
+        }
+        finished += n;
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &c : done) {
+            pending_run &r = pending[c.tag];
+            if (c.result != 0) {
+                ret = -1;
+                continue;
+            }
+            if (!r.write) {
+                overlay(r.block_no, r.count, r.buf, r.dirty);
+                continue;
+            }
+            for (unsigned i = 0; i < r.count; i++) {
+                auto it = entries.find(r.block_no + i);
+                uint8_t *data = r.buf + (size_t)i * disk.get_block_size();
+                if (it != entries.end() && memcmp(it->second.data.get(), data, disk.get_block_size()) == 0)
+                    it->second.dirty = false; // unless written again meanwhile
+            }
+        }
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    pending.clear();
+    return ret;
+}
+
+// drops count blocks from the cache and discards them on the disk
+int
+BlockCache::discard(unsigned block_no, unsigned count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (unsigned b = block_no; b < block_no + count && !entries.empty(); b++) {
+        auto it = entries.find(b);
+        if (it == entries.end())
+            continue;
+        (it->second.hot ? am : a1in).erase(it->second.pos);
+        buffers.put(std::move(it->second.data));
+        entries.erase(it);
+    }
+    unflushed = true;
+    overwritten(block_no, count);
+    written(block_no, count);
+    return disk.discard(block_no, count);
+}
+
+// writes the given cached blocks back, sorted by block number. Each run of
+// consecutive blocks goes to the disk with one vectored call straight from
+// the cache buffers. Called with the lock held.
+int
+BlockCache::write_back(const std::vector<unsigned> &blocks)
+{
+    int ret = 0;
+    std::vector<uint8_t*> bufs;
+    size_t i = 0;
+    while (i < blocks.size()) {
+        size_t j = i + 1;
+        while (j < blocks.size() && blocks[j] == blocks[j - 1] + 1)
+            j++;
+        bufs.clear();
+        for (size_t k = i; k < j; k++)
+            bufs.push_back(entries[blocks[k]].data.get());
+        if (disk.writev(blocks[i], (unsigned)(j - i), bufs.data()) != 0) {
+            ret = -1;
+        } else {
+            for (size_t k = i; k < j; k++)
+                entries[blocks[k]].dirty = false;
+            stats.writebacks += j - i;
+        }
+        i = j;
+    }
+    return ret;
+}
+
+// writes all dirty blocks back to the disk and flushes it
+int
+BlockCache::sync()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    // write back in block order so the disk sees one forward sweep
+    std::vector<unsigned> dirty;
+    for (auto &[block_no, e] : entries) {
+        if (e.dirty)
+            dirty.push_back(block_no);
+    }
+    std::sort(dirty.begin(), dirty.end());
+
+    int ret = write_back(dirty);
+    unflushed = false;
+    if (disk.flush() != 0)
+        ret = -1;
+    return ret;
+}
+
+// dirty blocks not in the journal yet, in block order
+std::vector<unsigned>
+BlockCache::get_unlogged()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<unsigned> blocks;
+    for (auto &[block_no, e] : entries) {
+        if (e.dirty && !e.logged)
+            blocks.push_back(block_no);
+    }
+    std::sort(blocks.begin(), blocks.end());
+    return blocks;
+}
+
+void
+BlockCache::mark_logged(const std::vector<unsigned> &blocks)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (unsigned block_no : blocks) {
+        auto it = entries.find(block_no);
+        if (it != entries.end())
+            it->second.logged = true;
+        in_log.insert(block_no);
+    }
+}
+
+std::vector<unsigned>
+BlockCache::take_revoked()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<unsigned> blocks;
+    blocks.swap(revoked);
+    return blocks;
+}
+
+// logged blocks that are dirty again, in block order
+std::vector<unsigned>
+BlockCache::get_relogged()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<unsigned> blocks;
+    for (unsigned block_no : in_log) {
+        auto it = entries.find(block_no);
+        if (it != entries.end() && it->second.dirty && !it->second.logged)
+            blocks.push_back(block_no);
+    }
+    std::sort(blocks.begin(), blocks.end());
+    return blocks;
+}
+
+// writes a committed image of a block home, the cached copy stays dirty
+int
+BlockCache::write_home(unsigned block_no, uint8_t *blk)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (disk.write(block_no, blk) != 0)
+        return -1;
+    unflushed = true;
+    stats.writebacks++;
+    return 0;
+}
+
+// writes the logged dirty blocks back home, in block order, and flushes
+int
+BlockCache::checkpoint()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<unsigned> logged;
+    for (auto &[block_no, e] : entries) {
+        if (e.dirty && e.logged)
+            logged.push_back(block_no);
+    }
+    std::sort(logged.begin(), logged.end());
+
+    int ret = write_back(logged);
+    unflushed = false;
+    if (disk.flush() != 0)
+        ret = -1;
+    if (ret == 0) {
+        in_log.clear();
+        revoked.clear();
+    }
+    return ret;
+}
+
+int
+BlockCache::flush()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (!unflushed)
+        return 0;
+    unflushed = false;
+    return disk.flush();
+}
+
+// drops all cached blocks without writing them back
+void
+BlockCache::invalidate()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &[block_no, e] : entries)
+        buffers.put(std::move(e.data));
+    entries.clear();
+    a1in.clear();
+    am.clear();
+    a1out.clear();
+    ghosts.clear();
+    in_log.clear();
+    revoked.clear();
+    configure();
+}
+
+bool
+BlockCache::over_capacity()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return entries.size() > capacity;
+}
+
+cache_stats
+BlockCache::get_stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+void
+BlockCache::reset_stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    stats = cache_stats();
+}
@@ -0,0 +1,172 @@
+// cache.h is the header file for the BlockCache class, a write-back buffer
+// cache that sits between the FS and the Disk.
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "disk.h"
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+// default budget in bytes (256 blocks of 4 KiB), the FS_CACHE_BLOCKS
+// environment variable sets a budget in blocks instead
+#define CACHE_BYTES (1 << 20)
+
+// Replacement follows the simplified 2Q policy. A block seen for the first
+// time goes into a small FIFO (a1in). When it falls out of a1in only its
+// number is remembered (a1out), and a block that is referenced again while
+// remembered there is promoted to the main LRU queue (am). A single large
+// cat or cp therefore streams through a1in without pushing the hot root,
+// FAT and directory blocks out of am.
+//
+// On a journaled volume a dirty block may only reach its home location once
+// the journal holds it: such blocks are pinned until logged and are not
+// evicted, the cache grows past its capacity instead. The cache also notes
+// which logged blocks are later overwritten in place or discarded, so the
+// journal can revoke their old images.
+//
+// All calls may come from several threads. Disk transfers of runs and of
+// missed blocks happen outside the lock, so threads reading different
+// blocks overlap. The asynchronous engine serves one thread at a time: runs
+// submitted by others while it is busy are done synchronously.
+class BlockCache {
+private:
+    struct cache_entry {
+        aligned_buf data;
+        bool dirty = false;
+        bool logged = false; // the dirty contents are in the journal
+        bool hot = false; // true if the block lives in am, false for a1in
+        std::list<unsigned>::iterator pos;
+    };
+
+    Disk &disk;
+    // block buffers are aligned so the direct backend needs no bounce
+    BufferPool buffers;
+    uint64_t budget;
+    unsigned capacity;
+    unsigned a1in_max;
+    unsigned a1out_max;
+
+    std::unordered_map<unsigned, cache_entry> entries;
+    // front of each list is the most recently inserted / used block
+    std::list<unsigned> a1in;
+    std::list<unsigned> am;
+    std::list<unsigned> a1out;
+    std::unordered_map<unsigned, std::list<unsigned>::iterator> ghosts;
+
+    // copies of the dirty cached blocks of a run, taken before it is read
+    // from the disk: an eviction may write one home and drop it meanwhile
+    struct dirty_copies {
+        std::vector<unsigned> blocks; // in block order
+        std::vector<uint8_t> data;
+    };
+    dirty_copies copy_dirty(unsigned block_no, unsigned count);
+    // puts the newest contents of the run's blocks over what the disk gave
+    void overlay(unsigned block_no, unsigned count, uint8_t *buf, const dirty_copies &dirty);
+
+    // asynchronous runs submitted but not finished yet, the index is the tag
+    struct pending_run {
+        unsigned block_no;
+        unsigned count;
+        uint8_t *buf;
+        bool write;
+        dirty_copies dirty; // of a read
+    };
+    std::vector<pending_run> pending;
+    // thread whose runs are in pending, no one's if it is empty
+    std::thread::id aio_owner;
+    cache_stats stats;
+    std::mutex lock;
+    // true if this thread may queue runs on the asynchronous engine
+    bool own_engine();
+
+    bool journaled = false;
+    bool unflushed = false; // writes since the last flush
+    // blocks with images in the journal since the last checkpoint, and the
+    // ones of them overwritten or discarded since the last commit
+    std::unordered_set<unsigned> in_log;
+    std::vector<unsigned> revoked;
+    void overwritten(unsigned block_no, unsigned count);
+
+    // misses being read from the disk outside the lock, by block: the
+    // threads reading it and the number of writes to it since. A miss that
+    // saw a write meanwhile is read again instead of being added.
+    struct load_state {
+        unsigned readers = 0;
+        uint64_t writes = 0;
+    };
+    std::unordered_map<unsigned, load_state> loads;
+    void written(unsigned block_no, unsigned count);
+    // copies the contents a queued write run gives a block, false if none
+    bool queued_contents(unsigned block_no, uint8_t *blk);
+
+    // returns the entry for block_no, loading it from disk if load is set
+    cache_entry *lookup(unsigned block_no, bool load);
+    // writes cached blocks back, a run of consecutive ones per disk call
+    int write_back(const std::vector<unsigned> &blocks);
+    // makes room for one more block, writing the victim back if dirty. 1 if
+    // every block is pinned.
+    int evict();
+    void remember(unsigned block_no);
+    // derives the capacity in blocks from the budget and the block size
+    void configure();
+
+public:
+    BlockCache(Disk &disk, uint64_t budget = CACHE_BYTES);
+    ~BlockCache();
+    // reads one block, from memory if cached
+    int read(unsigned block_no, uint8_t *blk);
+    // writes one block into the cache, it reaches the disk on eviction or sync
+    int write(unsigned block_no, uint8_t *blk);
+    // reads / writes count consecutive blocks with a single disk call. These
+    // are meant for bulk file data: blocks that are cached stay coherent, but
+    // the run itself is not added to the cache.
+    int read_run(unsigned block_no, unsigned count, uint8_t *buf);
+    int write_run(unsigned block_no, unsigned count, uint8_t *buf);
+    // asynchronous versions of read_run / write_run: the run is queued on the
+    // disk and wait_runs() blocks until every queued run has finished, keeping
+    // cached blocks coherent. Buffers must stay valid until then.
+    int submit_read_run(unsigned block_no, unsigned count, uint8_t *buf);
+    int submit_write_run(unsigned block_no, unsigned count, uint8_t *buf);
+    int wait_runs();
+    // drops count blocks from the cache without writing them back and
+    // discards them on the disk, they read back as zeros
+    int discard(unsigned block_no, unsigned count);
+    // writes all dirty blocks back to the disk and flushes it
+    int sync();
+    // drops all cached blocks without writing them back, needed after the
+    // block size of the disk changes
+    void invalidate();
+    unsigned get_block_size() { return disk.get_block_size(); }
+    unsigned get_capacity() { return capacity; }
+    // true if pinned blocks hold the cache above its capacity
+    bool over_capacity();
+
+    // journal support, see above
+    void set_journaled(bool journaled) { this->journaled = journaled; }
+    // dirty blocks not in the journal yet, in block order
+    std::vector<unsigned> get_unlogged();
+    // the dirty contents of blocks are now in the journal
+    void mark_logged(const std::vector<unsigned> &blocks);
+    // logged blocks overwritten or discarded since the last call
+    std::vector<unsigned> take_revoked();
+    // logged blocks that are dirty again, in block order. Their committed
+    // contents are only in the journal.
+    std::vector<unsigned> get_relogged();
+    // writes a committed image of a block home, leaving the cached copy as
+    // it is
+    int write_home(unsigned block_no, uint8_t *blk);
+    // writes the logged dirty blocks back home and flushes the disk, after
+    // which the journal is not needed for them
+    int checkpoint();
+    // flushes the disk if anything was written since the last flush
+    int flush();
+    cache_stats get_stats();
+    void reset_stats();
+};
+
+#endif // __CACHE_H__
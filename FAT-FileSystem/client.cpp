@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "client.h"
+
+FsClient::~FsClient()
+{
+    if (fd >= 0)
+        ::close(fd);
+}
+
+int
+FsClient::connect(const std::string &path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        return -1;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t
+FsClient::send(uint8_t op, const void *args, size_t args_len, const void *data, size_t data_len)
+{
+    request_header h = { (uint32_t)(args_len + data_len), next_id++, op, {0, 0, 0} };
+    const uint8_t *hp = reinterpret_cast<const uint8_t*>(&h);
+    out.insert(out.end(), hp, hp + sizeof(h));
+    if (args_len > 0)
+        out.insert(out.end(), static_cast<const uint8_t*>(args), static_cast<const uint8_t*>(args) + args_len);
+    if (data_len > 0)
+        out.insert(out.end(), static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + data_len);
+    return h.id;
+}
+
+int
+FsClient::flush()
+{
+    size_t done = 0;
+    while (done < out.size()) {
+        ssize_t n = ::send(fd, out.data() + done, out.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += (size_t)n;
+    }
+    out.clear();
+    return 0;
+}
+
+// makes n received bytes from in_pos on available
+int
+FsClient::fill(size_t n)
+{
+    if (in.size() - in_pos >= n)
+        return 0;
+    in.erase(in.begin(), in.begin() + in_pos);
+    in_pos = 0;
+    while (in.size() < n) {
+        size_t have = in.size();
+        in.resize(std::max(n, have + 64 * 1024));
+        ssize_t got = recv(fd, in.data() + have, in.size() - have, 0);
+        in.resize(have + (got > 0 ? (size_t)got : 0));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+int
+FsClient::receive(response_header &h, std::vector<uint8_t> *data)
+{
+    if (flush() != 0 || fill(sizeof(h)) != 0)
+        return -1;
+    memcpy(&h, in.data() + in_pos, sizeof(h));
+    if (h.len > PROTO_MAX_PAYLOAD || fill(sizeof(h) + h.len) != 0)
+        return -1;
+    const uint8_t *payload = in.data() + in_pos + sizeof(h);
+    if (data != nullptr)
+        data->assign(payload, payload + h.len);
+    in_pos += sizeof(h) + h.len;
+    return 0;
+}
+
+// sends one request and waits for its response. The responses to requests
+// queued before it are skipped.
+int64_t
+FsClient::call(uint8_t op, const void *args, size_t args_len, const void *data, size_t data_len,
+               std::vector<uint8_t> *reply)
+{
+    uint32_t id = send(op, args, args_len, data, data_len);
+    response_header h;
+    do {
+        if (receive(h, reply) != 0)
+            return -1;
+    } while (h.id != id);
+    return h.result;
+}
+
+int64_t
+FsClient::call_paths(uint8_t op, const std::string &first, const std::string &second)
+{
+    uint32_t first_len = (uint32_t)first.size();
+    std::string args(reinterpret_cast<const char*>(&first_len), sizeof(first_len));
+    args += first;
+    args += second;
+    return call(op, args.data(), args.size());
+}
+
+int
+FsClient::ping()
+{
+    return (int)call(REQ_PING, nullptr, 0);
+}
+
+int
+FsClient::open(const std::string &path, uint32_t flags)
+{
+    std::string args(reinterpret_cast<const char*>(&flags), sizeof(flags));
+    args += path;
+    return (int)call(REQ_OPEN, args.data(), args.size());
+}
+
+int64_t
+FsClient::read(int fd, uint8_t *buf, uint32_t len, int64_t offset)
+{
+    io_args io = { fd, len, offset };
+    std::vector<uint8_t> reply;
+    int64_t n = call(REQ_READ, &io, sizeof(io), nullptr, 0, &reply);
+    if (n > 0)
+        memcpy(buf, reply.data(), std::min(reply.size(), (size_t)n));
+    return n;
+}
+
+int64_t
+FsClient::write(int fd, const uint8_t *buf, uint32_t len, int64_t offset)
+{
+    io_args io = { fd, len, offset };
+    return call(REQ_WRITE, &io, sizeof(io), buf, len);
+}
+
+int64_t
+FsClient::seek(int fd, int64_t offset, int whence)
+{
+    io_args io = { fd, (uint32_t)whence, offset };
+    return call(REQ_SEEK, &io, sizeof(io));
+}
+
+int
+FsClient::close(int fd)
+{
+    io_args io = { fd, 0, 0 };
+    return (int)call(REQ_CLOSE, &io, sizeof(io));
+}
+
+int
+FsClient::mkdir(const std::string &path)
+{
+    return (int)call(REQ_MKDIR, path.data(), path.size());
+}
+
+int
+FsClient::rm(const std::string &path)
+{
+    return (int)call(REQ_RM, path.data(), path.size());
+}
+
+int
+FsClient::cp(const std::string &source, const std::string &dest)
+{
+    return (int)call_paths(REQ_CP, source, dest);
+}
+
+int
+FsClient::mv(const std::string &source, const std::string &dest)
+{
+    return (int)call_paths(REQ_MV, source, dest);
+}
+
+int
+FsClient::append(const std::string &source, const std::string &dest)
+{
+    return (int)call_paths(REQ_APPEND, source, dest);
+}
+
+int
+FsClient::sync()
+{
+    return (int)call(REQ_SYNC, nullptr, 0);
+}
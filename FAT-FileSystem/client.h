@@ -0,0 +1,54 @@
+// client.h is the header file for the FsClient class, a connection to the
+// file system server (test_fs --serve) speaking the protocol of protocol.h.
+#include <string>
+#include <vector>
+#include "protocol.h"
+
+#ifndef __CLIENT_H__
+#define __CLIENT_H__
+
+// Requests can be pipelined: send queues a request and returns its id, and
+// receive flushes the queue and returns the next response, in the order
+// the requests were sent. The other calls send one request and wait for
+// its answer. An FsClient is used by one thread at a time.
+class FsClient {
+private:
+    int fd = -1;
+    uint32_t next_id = 1;
+    std::vector<uint8_t> out; // requests not sent yet
+    std::vector<uint8_t> in; // received bytes, the ones before in_pos are used
+    size_t in_pos = 0;
+
+    int fill(size_t n);
+    int64_t call(uint8_t op, const void *args, size_t args_len, const void *data = nullptr,
+                 size_t data_len = 0, std::vector<uint8_t> *reply = nullptr);
+    int64_t call_paths(uint8_t op, const std::string &first, const std::string &second);
+
+public:
+    ~FsClient();
+    int connect(const std::string &path);
+    // queues a request, returns its id
+    uint32_t send(uint8_t op, const void *args, size_t args_len, const void *data = nullptr,
+                  size_t data_len = 0);
+    // sends the queued requests
+    int flush();
+    // waits for the next response, its payload goes to data if given
+    int receive(response_header &h, std::vector<uint8_t> *data = nullptr);
+
+    int ping();
+    // flags are PROTO_OPEN_*
+    int open(const std::string &path, uint32_t flags);
+    // offset -1 reads / writes at the current position
+    int64_t read(int fd, uint8_t *buf, uint32_t len, int64_t offset = -1);
+    int64_t write(int fd, const uint8_t *buf, uint32_t len, int64_t offset = -1);
+    int64_t seek(int fd, int64_t offset, int whence);
+    int close(int fd);
+    int mkdir(const std::string &path);
+    int rm(const std::string &path);
+    int cp(const std::string &source, const std::string &dest);
+    int mv(const std::string &source, const std::string &dest);
+    int append(const std::string &source, const std::string &dest);
+    int sync();
+};
+
+#endif // __CLIENT_H__
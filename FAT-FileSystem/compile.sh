@@ -9,10 +9,23 @@ else
     echo "$FILE does not exist."
 fi
 
-if g++ main.cpp shell.cpp fs.cpp disk.cpp -o test_fs; then
+if g++ main.cpp shell.cpp fs.cpp fat.cpp cache.cpp journal.cpp disk.cpp aio.cpp stats.cpp stress.cpp server.cpp -pthread -o test_fs; then
     echo "Compilation successful. Output: $FILE"
 else
     echo "Compilation failed."
     exit 1
 fi
 
+if g++ loadgen.cpp client.cpp stats.cpp -pthread -o loadgen; then
+    echo "Compilation successful. Output: loadgen"
+else
+    echo "Compilation failed."
+    exit 1
+fi
+
+if g++ journal_test.cpp fs.cpp fat.cpp cache.cpp journal.cpp disk.cpp aio.cpp stats.cpp -pthread -o journal_test; then
+    echo "Compilation successful. Output: journal_test"
+else
+    echo "Compilation failed."
+    exit 1
+fi
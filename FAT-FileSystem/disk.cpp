@@ -1,4 +1,15 @@
 #include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "disk.h"
 
 Disk::Disk()
@@ -8,20 +19,90 @@ Disk::Disk()
         std::cout << "No disk file found...\n";
         std::cout << "Creating disk file: " << DISKNAME << std::endl;
         std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
+        f.seekp((uint64_t)DEFAULT_NO_BLOCKS * DEFAULT_BLOCK_SIZE - 1);
         f.write("", 1);
     }
+
     // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
+    fd = open(DISKNAME, O_RDWR);
+    if (fd < 0) {
         std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
         exit(-1);
     }
+    no_blocks = (uint64_t)lseek(fd, 0, SEEK_END) / block_size;
+    disk_size = (uint64_t)no_blocks * block_size;
+
+    const char *env = getenv("FS_DISK_BACKEND");
+    if (env != nullptr && std::string(env) == "mmap") {
+        if (map_image()) {
+            backend = BACKEND_MMAP;
+            return;
+        }
+        std::cerr << "WARNING: Can't mmap diskfile: " << DISKNAME << ", using the file backend\n";
+    } else if (env != nullptr && std::string(env) == "direct") {
+        int direct_fd = open(DISKNAME, O_RDWR | O_DIRECT);
+        if (direct_fd >= 0) {
+            close(fd);
+            fd = direct_fd;
+            backend = BACKEND_DIRECT;
+            return;
+        }
+        std::cerr << "WARNING: Can't open diskfile: " << DISKNAME << " with O_DIRECT, using the file backend\n";
+    } else if (env != nullptr && std::string(env) != "file") {
+        std::cerr << "WARNING: Unknown disk backend '" << env << "', using the file backend\n";
+    }
 }
 
 Disk::~Disk()
 {
-    diskfile.close();
+    // waits for everything still in flight
+    engine.reset();
+    if (backend == BACKEND_MMAP) {
+        flush();
+        unmap_image();
+    }
+    close(fd);
+}
+
+aligned_buf
+alloc_aligned(size_t len)
+{
+    void *p = nullptr;
+    if (posix_memalign(&p, DIRECT_ALIGN, std::max(len, (size_t)1)) != 0)
+        throw std::bad_alloc();
+    return aligned_buf((uint8_t*)p);
+}
+
+// changes the buffer size, dropping the spare buffers
+void
+BufferPool::set_size(size_t size)
+{
+    if (size != this->size)
+        spare.clear();
+    this->size = size;
+}
+
+aligned_buf
+BufferPool::get()
+{
+    if (spare.empty())
+        return alloc_aligned(size);
+    aligned_buf buf = std::move(spare.back());
+    spare.pop_back();
+    return buf;
+}
+
+void
+BufferPool::put(aligned_buf buf)
+{
+    if (buf)
+        spare.push_back(std::move(buf));
+}
+
+static bool
+is_aligned(const void *p)
+{
+    return ((uintptr_t)p % DIRECT_ALIGN) == 0;
 }
 
 bool
@@ -30,37 +111,431 @@ Disk::disk_file_exists (const std::string& name) {
     return f.good();
 }
 
-// writes one block to the disk
+// maps the whole disk file
+bool
+Disk::map_image()
+{
+    if (disk_size == 0)
+        return false;
+    void *p = mmap(nullptr, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return false;
+    mapping = (uint8_t*)p;
+    return true;
+}
+
+void
+Disk::unmap_image()
+{
+    if (mapping != nullptr) {
+        msync(mapping, disk_size, MS_SYNC);
+        munmap(mapping, disk_size);
+        mapping = nullptr;
+    }
+}
+
+// switches to blocks of block_size bytes and grows or shrinks the disk file
+// to no_blocks of them
 int
-Disk::write(unsigned block_no, uint8_t *blk)
+Disk::set_geometry(unsigned block_size, unsigned no_blocks)
 {
-    if (DEBUG)
-        std::cout << "Disk::write(" << block_no << ")\n";
-    // check if valid block number
-    if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        std::cout << "Disk::set_geometry - ERROR: Invalid block size (" << block_size << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
+    uint64_t file_size = (uint64_t)lseek(fd, 0, SEEK_END);
+    if (no_blocks == 0)
+        no_blocks = file_size / block_size;
+    uint64_t new_size = (uint64_t)no_blocks * block_size;
+    if (block_size == this->block_size && new_size == disk_size)
+        return 0;
+
+    if (backend == BACKEND_MMAP)
+        unmap_image();
+    int ret = 0;
+    if (new_size != file_size && ftruncate(fd, new_size) != 0) {
+        std::cout << "Disk::set_geometry - ERROR: Can't resize diskfile to " << new_size << " bytes\n";
+        ret = -1;
+    } else {
+        this->block_size = block_size;
+        this->no_blocks = no_blocks;
+        this->disk_size = new_size;
+    }
+    if (backend == BACKEND_MMAP && !map_image()) {
+        std::cerr << "ERROR: Can't mmap diskfile: " << DISKNAME << ", exiting..." << std::endl;
+        exit(-1);
+    }
+    return ret;
+}
+
+// writes count blocks at offset off, one buffer per block
+static int
+full_writev(int fd, uint8_t **bufs, unsigned count, unsigned block_size, off_t off)
+{
+    std::vector<struct iovec> iov;
+    unsigned done = 0;
+    while (done < count) {
+        unsigned n = std::min(count - done, (unsigned)IOV_MAX);
+        iov.resize(n);
+        for (unsigned i = 0; i < n; i++) {
+            iov[i].iov_base = bufs[done + i];
+            iov[i].iov_len = block_size;
+        }
+        ssize_t r = pwritev(fd, iov.data(), n, off);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // finish a short transfer block by block
+        size_t moved = (size_t)r;
+        for (unsigned i = 0; moved < (size_t)n * block_size && i < n; i++) {
+            size_t blk_done = std::min(moved - std::min(moved, (size_t)i * block_size), (size_t)block_size);
+            if (blk_done < block_size &&
+                full_transfer(fd, true, bufs[done + i] + blk_done, block_size - blk_done,
+                         off + (off_t)i * block_size + blk_done) != 0)
+                return -1;
+        }
+        done += n;
+        off += (off_t)n * block_size;
+    }
     return 0;
 }
 
+bool
+Disk::valid_run(const char *op, unsigned block_no, unsigned count)
+{
+    // check if valid block numbers
+    if (block_no >= no_blocks || count > no_blocks - block_no) {
+        std::cout << "Disk::" << op << " - ERROR: Invalid block number (" << block_no;
+        if (count != 1)
+            std::cout << " + " << count;
+        std::cout << ")\n";
+        return false;
+    }
+    return true;
+}
+
+// writes one block to the disk
+int
+Disk::write(unsigned block_no, uint8_t *blk)
+{
+    return write_blocks(block_no, 1, blk);
+}
+
 // reads one block from the disk
 int
 Disk::read(unsigned block_no, uint8_t *blk)
+{
+    return read_blocks(block_no, 1, blk);
+}
+
+// sets the layout used to classify blocks in the statistics
+void
+Disk::set_layout(unsigned fat_start, unsigned data_start, unsigned journal_start)
+{
+    this->fat_start = fat_start;
+    this->journal_start = (journal_start != 0) ? journal_start : data_start;
+    this->data_start = data_start;
+    dir_words = ((size_t)no_blocks + 63) / 64;
+    dir_bits.reset(new std::atomic<uint64_t>[dir_words]());
+}
+
+void
+Disk::set_dir_block(unsigned block_no, bool is_dir)
+{
+    if (block_no / 64 >= dir_words)
+        return;
+    uint64_t bit = (uint64_t)1 << (block_no % 64);
+    // known blocks are only read, no write to the shared word
+    if (((dir_bits[block_no / 64].load(std::memory_order_relaxed) & bit) != 0) == is_dir)
+        return;
+    if (is_dir)
+        dir_bits[block_no / 64].fetch_or(bit, std::memory_order_relaxed);
+    else
+        dir_bits[block_no / 64].fetch_and(~bit, std::memory_order_relaxed);
+}
+
+int
+Disk::block_type(unsigned block_no)
+{
+    return classify(block_no);
+}
+
+int
+Disk::classify(unsigned block_no)
+{
+    if (block_no == 0)
+        return BT_SUPER;
+    if (block_no < fat_start)
+        return BT_ROOT;
+    if (block_no < journal_start)
+        return BT_FAT;
+    if (block_no < data_start)
+        return BT_JOURNAL;
+    bool dir = block_no / 64 < dir_words &&
+               (dir_bits[block_no / 64].load(std::memory_order_relaxed) >> (block_no % 64) & 1) != 0;
+    return dir ? BT_DIR : BT_DATA;
+}
+
+io_stats
+Disk::get_stats()
+{
+    io_stats s;
+    for (int t = 0; t < BT_COUNT; t++) {
+        s.blocks_read[t] = stats.blocks_read[t].load(std::memory_order_relaxed);
+        s.blocks_written[t] = stats.blocks_written[t].load(std::memory_order_relaxed);
+    }
+    s.read_calls = stats.read_calls.load(std::memory_order_relaxed);
+    s.write_calls = stats.write_calls.load(std::memory_order_relaxed);
+    s.bytes_read = stats.bytes_read.load(std::memory_order_relaxed);
+    s.bytes_written = stats.bytes_written.load(std::memory_order_relaxed);
+    s.flushes = stats.flushes.load(std::memory_order_relaxed);
+    return s;
+}
+
+void
+Disk::reset_stats()
+{
+    for (int t = 0; t < BT_COUNT; t++) {
+        stats.blocks_read[t].store(0, std::memory_order_relaxed);
+        stats.blocks_written[t].store(0, std::memory_order_relaxed);
+    }
+    for (std::atomic<uint64_t> *c : { &stats.read_calls, &stats.write_calls, &stats.bytes_read,
+                                      &stats.bytes_written, &stats.flushes })
+        c->store(0, std::memory_order_relaxed);
+}
+
+void
+Disk::account(bool write, unsigned block_no, unsigned count)
+{
+    std::atomic<uint64_t> *blocks = write ? stats.blocks_written : stats.blocks_read;
+    (write ? stats.write_calls : stats.read_calls).fetch_add(1, std::memory_order_relaxed);
+    (write ? stats.bytes_written : stats.bytes_read).fetch_add((uint64_t)count * block_size, std::memory_order_relaxed);
+    // one add per block type, runs are mostly of one type
+    int type = classify(block_no);
+    unsigned same = 1;
+    for (unsigned i = 1; i < count; i++) {
+        int t = classify(block_no + i);
+        if (t != type) {
+            blocks[type].fetch_add(same, std::memory_order_relaxed);
+            type = t;
+            same = 0;
+        }
+        same++;
+    }
+    blocks[type].fetch_add(same, std::memory_order_relaxed);
+}
+
+// positional transfer of len bytes, bouncing unaligned buffers
+int
+Disk::transfer(bool write, uint8_t *buf, size_t len, off_t offset)
+{
+    if (backend != BACKEND_DIRECT || is_aligned(buf))
+        return full_transfer(fd, write, buf, len, offset);
+    aligned_buf b = alloc_aligned(len);
+    if (write)
+        memcpy(b.get(), buf, len);
+    if (full_transfer(fd, write, b.get(), len, offset) != 0)
+        return -1;
+    if (!write)
+        memcpy(buf, b.get(), len);
+    return 0;
+}
+
+// reads count consecutive blocks into one contiguous buffer
+int
+Disk::read_blocks(unsigned block_no, unsigned count, uint8_t *buf)
+{
+    if (DEBUG)
+        std::cout << "Disk::read(" << block_no << ", " << count << ")\n";
+    if (!valid_run("read", block_no, count))
+        return -1;
+    account(false, block_no, count);
+    off_t offset = (off_t)block_no * block_size;
+    if (backend == BACKEND_MMAP) {
+        memcpy(buf, mapping + offset, (size_t)count * block_size);
+        return 0;
+    }
+    return transfer(false, buf, (size_t)count * block_size, offset);
+}
+
+// writes count consecutive blocks from one contiguous buffer
+int
+Disk::write_blocks(unsigned block_no, unsigned count, uint8_t *buf)
+{
+    if (DEBUG)
+        std::cout << "Disk::write(" << block_no << ", " << count << ")\n";
+    if (!valid_run("write", block_no, count))
+        return -1;
+    account(true, block_no, count);
+    off_t offset = (off_t)block_no * block_size;
+    if (backend == BACKEND_MMAP) {
+        // reaches the file when the kernel writes the pages back or on flush()
+        memcpy(mapping + offset, buf, (size_t)count * block_size);
+        return 0;
+    }
+    return transfer(true, buf, (size_t)count * block_size, offset);
+}
+
+// writes count consecutive blocks, one buffer per block
+int
+Disk::writev(unsigned block_no, unsigned count, uint8_t **bufs)
+{
+    if (DEBUG)
+        std::cout << "Disk::writev(" << block_no << ", " << count << ")\n";
+    if (!valid_run("writev", block_no, count))
+        return -1;
+    account(true, block_no, count);
+    off_t offset = (off_t)block_no * block_size;
+    if (backend == BACKEND_MMAP) {
+        for (unsigned i = 0; i < count; i++)
+            memcpy(mapping + offset + (off_t)i * block_size, bufs[i], block_size);
+        return 0;
+    }
+    if (backend == BACKEND_DIRECT && !std::all_of(bufs, bufs + count, is_aligned)) {
+        for (unsigned i = 0; i < count; i++) {
+            if (transfer(true, bufs[i], block_size, offset + (off_t)i * block_size) != 0)
+                return -1;
+        }
+        return 0;
+    }
+    return full_writev(fd, bufs, count, block_size, offset);
+}
+
+int
+Disk::submit(bool write, unsigned block_no, unsigned count, uint8_t *buf, uint64_t tag)
+{
+    if (DEBUG)
+        std::cout << "Disk::submit_" << (write ? "write(" : "read(") << block_no << ", " << count << ")\n";
+    if (!valid_run(write ? "submit_write" : "submit_read", block_no, count)) {
+        ready.push_back({tag, -1});
+        return -1;
+    }
+    account(write, block_no, count);
+    off_t offset = (off_t)block_no * block_size;
+    size_t len = (size_t)count * block_size;
+    if (backend == BACKEND_MMAP) {
+        // nothing to wait for, the transfer is a memcpy
+        if (write)
+            memcpy(mapping + offset, buf, len);
+        else
+            memcpy(buf, mapping + offset, len);
+        ready.push_back({tag, 0});
+        return 0;
+    }
+    if (!engine)
+        engine.reset(new AsyncEngine());
+    if (backend == BACKEND_DIRECT && !is_aligned(buf)) {
+        bounce &b = bounces[tag];
+        b.buf = alloc_aligned(len);
+        b.dest = buf;
+        b.len = len;
+        b.write = write;
+        if (write)
+            memcpy(b.buf.get(), buf, len);
+        buf = b.buf.get();
+    }
+    return engine->submit({fd, write, buf, len, offset, tag});
+}
+
+// copies finished bounced reads back to their buffers
+void
+Disk::finish_bounces(std::vector<aio_completion> &out, size_t from)
+{
+    if (bounces.empty())
+        return;
+    for (size_t i = from; i < out.size(); i++) {
+        auto it = bounces.find(out[i].tag);
+        if (it == bounces.end())
+            continue;
+        bounce &b = it->second;
+        if (!b.write && out[i].result == 0)
+            memcpy(b.dest, b.buf.get(), b.len);
+        bounces.erase(it);
+    }
+}
+
+// queues a read of count consecutive blocks
+int
+Disk::submit_read(unsigned block_no, unsigned count, uint8_t *buf, uint64_t tag)
+{
+    return submit(false, block_no, count, buf, tag);
+}
+
+// queues a write of count consecutive blocks
+int
+Disk::submit_write(unsigned block_no, unsigned count, uint8_t *buf, uint64_t tag)
+{
+    return submit(true, block_no, count, buf, tag);
+}
+
+// hands out finished transfers without blocking
+unsigned
+Disk::poll(std::vector<aio_completion> &out)
+{
+    size_t from = out.size();
+    unsigned n = ready.size();
+    out.insert(out.end(), ready.begin(), ready.end());
+    ready.clear();
+    if (engine)
+        n += engine->poll(out);
+    finish_bounces(out, from);
+    return n;
+}
+
+// hands out finished transfers, blocking until at least min_complete are done
+unsigned
+Disk::wait(std::vector<aio_completion> &out, unsigned min_complete)
+{
+    unsigned n = poll(out);
+    if (n < min_complete && engine) {
+        size_t from = out.size();
+        n += engine->wait(out, min_complete - n);
+        finish_bounces(out, from);
+    }
+    return n;
+}
+
+// gives count blocks back to the host file system, they read back as zeros
+int
+Disk::discard(unsigned block_no, unsigned count)
 {
     if (DEBUG)
-        std::cout << "Disk::read(" << block_no << ")\n";
-    // check if valid block number
-    if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
+        std::cout << "Disk::discard(" << block_no << ", " << count << ")\n";
+    if (!valid_run("discard", block_no, count))
+        return -1;
+    off_t offset = (off_t)block_no * block_size;
+    off_t len = (off_t)count * block_size;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+        return 0;
+
+    // no hole punching on this file system, write zeros instead
+    unsigned run = std::max(1u, (256u << 10) / block_size);
+    aligned_buf zero = alloc_aligned((size_t)run * block_size);
+    memset(zero.get(), 0, (size_t)run * block_size);
+    for (unsigned i = 0; i < count; i += run) {
+        if (write_blocks(block_no + i, std::min(run, count - i), zero.get()) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// makes all writes so far durable
+int
+Disk::flush()
+{
+    stats.flushes.fetch_add(1, std::memory_order_relaxed);
+    if (backend == BACKEND_MMAP) {
+        if (msync(mapping, disk_size, MS_SYNC) != 0) {
+            std::cout << "Disk::flush - ERROR: msync failed\n";
+            return -1;
+        }
+        return 0;
+    }
+    if (fdatasync(fd) != 0) {
+        std::cout << "Disk::flush - ERROR: fdatasync failed\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
     return 0;
 }
@@ -1,28 +1,159 @@
 #include <iostream>
 #include <fstream>
+#include <cstdlib>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "aio.h"
+#include "stats.h"
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
-#define BLOCK_SIZE 4096
+// the block size is chosen per volume by format, a power of two between
+// MIN_BLOCK_SIZE and MAX_BLOCK_SIZE. The disk starts out with the default
+// until the superblock says otherwise.
+#define DEFAULT_BLOCK_SIZE 4096
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (1 << 20)
+// size of a newly created disk file (8 MiB)
+#define DEFAULT_NO_BLOCKS 2048
 #define DEBUG false
 
+// the backend is picked at startup with the FS_DISK_BACKEND environment
+// variable: "file" (default), "mmap" or "direct"
+#define BACKEND_FILE 0
+#define BACKEND_MMAP 1
+#define BACKEND_DIRECT 2
+// buffer alignment O_DIRECT needs, block offsets and sizes are multiples of it
+#define DIRECT_ALIGN 4096
+
+struct aligned_free {
+    void operator()(uint8_t *p) { free(p); }
+};
+typedef std::unique_ptr<uint8_t[], aligned_free> aligned_buf;
+// allocates len bytes aligned to DIRECT_ALIGN
+aligned_buf alloc_aligned(size_t len);
+
+// hands out DIRECT_ALIGN aligned buffers of one size, keeping returned ones
+// for reuse
+class BufferPool {
+private:
+    size_t size;
+    std::vector<aligned_buf> spare;
+public:
+    BufferPool(size_t size = 0) : size(size) {}
+    size_t get_size() { return size; }
+    // changes the buffer size, dropping the spare buffers
+    void set_size(size_t size);
+    aligned_buf get();
+    void put(aligned_buf buf);
+};
+
 class Disk {
 private:
-    std::fstream diskfile;
-    const unsigned no_blocks = 2048;
-    const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    // the geometry follows the size of the disk file, see set_geometry()
+    unsigned block_size = DEFAULT_BLOCK_SIZE;
+    unsigned no_blocks = 0;
+    uint64_t disk_size = 0;
+    int backend = BACKEND_FILE;
+    // the file backend uses positional I/O on fd, the mmap backend maps the
+    // whole image shared and flush() is the msync. The direct backend opens
+    // fd with O_DIRECT, bypassing the page cache
+    int fd = -1;
+    uint8_t *mapping = nullptr;
+    // created on the first asynchronous request
+    std::unique_ptr<AsyncEngine> engine;
+    // completions of requests that finished at submit time (mmap backend,
+    // invalid block numbers)
+    std::vector<aio_completion> ready;
+    // the direct backend moves unaligned buffers through aligned bounce
+    // buffers, the ones of asynchronous requests are kept here by tag
+    struct bounce {
+        aligned_buf buf;
+        uint8_t *dest;
+        size_t len;
+        bool write;
+    };
+    std::unordered_map<uint64_t, bounce> bounces;
+    // block types for the statistics: the FS tells where the FAT, the
+    // journal and the data area start and which blocks hold directories
+    // (bit i of word i / 64 of dir_bits)
+    unsigned fat_start = 0;
+    unsigned journal_start = 0;
+    unsigned data_start = 0;
+    std::unique_ptr<std::atomic<uint64_t>[]> dir_bits;
+    size_t dir_words = 0;
+    // The block transfers use positional I/O and can run in several threads
+    // at once, so the statistics are relaxed atomic counters and get_stats()
+    // copies them
+    struct io_counters {
+        std::atomic<uint64_t> blocks_read[BT_COUNT] = {};
+        std::atomic<uint64_t> blocks_written[BT_COUNT] = {};
+        std::atomic<uint64_t> read_calls{0};
+        std::atomic<uint64_t> write_calls{0};
+        std::atomic<uint64_t> bytes_read{0};
+        std::atomic<uint64_t> bytes_written{0};
+        std::atomic<uint64_t> flushes{0};
+    };
+    io_counters stats;
+    int classify(unsigned block_no);
+    void account(bool write, unsigned block_no, unsigned count);
     bool disk_file_exists (const std::string& name);
+    bool map_image();
+    void unmap_image();
+    bool valid_run(const char *op, unsigned block_no, unsigned count);
+    // positional transfer of len bytes, bouncing unaligned buffers
+    int transfer(bool write, uint8_t *buf, size_t len, off_t offset);
+    // copies finished bounced reads back to their buffers
+    void finish_bounces(std::vector<aio_completion> &out, size_t from);
+    int submit(bool write, unsigned block_no, unsigned count, uint8_t *buf, uint64_t tag);
 public:
     Disk();
     ~Disk();
+    unsigned get_block_size() { return block_size; }
     unsigned get_no_blocks() { return no_blocks; }
-    unsigned get_disk_size() { return disk_size; }
+    uint64_t get_disk_size() { return disk_size; }
+    // switches to blocks of block_size bytes and grows or shrinks the disk
+    // file to no_blocks of them. no_blocks 0 keeps the size of the file.
+    int set_geometry(unsigned block_size, unsigned no_blocks = 0);
+    int get_backend() { return backend; }
+    // sets the layout used to classify blocks in the statistics, forgetting
+    // the directory blocks. The journal, if any, ends where the data starts.
+    void set_layout(unsigned fat_start, unsigned data_start, unsigned journal_start = 0);
+    // notes whether a block holds a directory, once when that changes
+    void set_dir_block(unsigned block_no, bool is_dir);
+    int block_type(unsigned block_no);
+    io_stats get_stats();
+    void reset_stats();
     // writes one block to the disk
     int write(unsigned block_no, uint8_t *blk);
     // reads one block from the disk
     int read(unsigned block_no, uint8_t *blk);
+    // reads / writes count consecutive blocks from / to one contiguous buffer
+    int read_blocks(unsigned block_no, unsigned count, uint8_t *buf);
+    int write_blocks(unsigned block_no, unsigned count, uint8_t *buf);
+    // writes count consecutive blocks from one buffer per block (gather), in
+    // a single pwritev call where possible
+    int writev(unsigned block_no, unsigned count, uint8_t **bufs);
+    // asynchronous I/O: submit_read / submit_write queue a transfer of count
+    // consecutive blocks and return at once, the buffer must stay untouched
+    // until its completion (tag, result) is handed out by poll or wait. At
+    // most FS_AIO_DEPTH transfers are in flight, submit waits for a free slot
+    // beyond that. Only one thread at a time may use these.
+    int submit_read(unsigned block_no, unsigned count, uint8_t *buf, uint64_t tag);
+    int submit_write(unsigned block_no, unsigned count, uint8_t *buf, uint64_t tag);
+    unsigned poll(std::vector<aio_completion> &out);
+    unsigned wait(std::vector<aio_completion> &out, unsigned min_complete = 1);
+    // gives count blocks back to the host file system by punching a hole in
+    // the image, they read back as zeros. Writes zeros where holes can't be
+    // punched.
+    int discard(unsigned block_no, unsigned count);
+    // makes all writes so far durable
+    int flush();
 };
 
 #endif // __DISK_H__
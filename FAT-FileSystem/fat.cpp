@@ -0,0 +1,262 @@
+#include <algorithm>
+#include <cstdlib>
+#include "fat.h"
+
+FatTable::FatTable(BlockCache &cache, unsigned max_pages, bool track_free)
+    : cache(cache), track_free(track_free)
+{
+    const char *env = getenv("FS_FAT_PAGES");
+    if (env != nullptr && atoi(env) > 0)
+        max_pages = (unsigned)atoi(env);
+    this->max_pages = (max_pages < 2) ? 2 : max_pages;
+}
+
+// sets the FAT location and size for the current block size, dropping all
+// resident pages
+void
+FatTable::attach(unsigned start_block, unsigned no_entries, bool all_free)
+{
+    reset();
+    std::lock_guard<std::mutex> guard(lock);
+    this->start_block = start_block;
+    this->no_entries = no_entries;
+    this->per_page = cache.get_block_size() / FAT_ENTRY_SIZE;
+
+    // build the free-space bitmap, reading the FAT once
+    free_bits.assign(track_free ? (no_entries + 63) / 64 : 0, 0);
+    no_free = 0;
+    first_free_word = 0;
+    for (unsigned i = 0; i < no_entries && track_free; i++) {
+        if (all_free) {
+            mark_free(i, true);
+            continue;
+        }
+        fat_page *p = page(i / per_page);
+        if (p != nullptr && p->entries[i % per_page] == FAT_FREE)
+            mark_free(i, true);
+    }
+}
+
+void
+FatTable::mark_free(unsigned index, bool free)
+{
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    uint64_t &word = free_bits[index / 64];
+    if (free && (word & bit) == 0) {
+        word |= bit;
+        no_free++;
+        first_free_word = std::min(first_free_word, index / 64);
+    } else if (!free && (word & bit) != 0) {
+        word &= ~bit;
+        no_free--;
+    }
+}
+
+unsigned
+FatTable::get_no_free()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return no_free;
+}
+
+// returns the first free block at or after from, -1 if there is none
+int
+FatTable::find_free(unsigned from)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    unsigned w = std::max(from / 64, first_free_word);
+    uint64_t mask = (w == from / 64) ? ~(uint64_t)0 << (from % 64) : ~(uint64_t)0;
+    bool skipped_used = (w == first_free_word);
+    for (; w < free_bits.size(); w++, mask = ~(uint64_t)0) {
+        uint64_t word = free_bits[w] & mask;
+        if (word != 0)
+            return (int)(w * 64 + __builtin_ctzll(word));
+        // words with no free bit at all are not looked at again
+        if (skipped_used && free_bits[w] == 0)
+            first_free_word = w + 1;
+        else
+            skipped_used = false;
+    }
+    return -1;
+}
+
+// number of blocks the FAT of a volume with no_blocks blocks of block_size
+// bytes needs
+unsigned
+FatTable::blocks_for(unsigned no_blocks, unsigned block_size)
+{
+    unsigned per_block = block_size / FAT_ENTRY_SIZE;
+    return (no_blocks + per_block - 1) / per_block;
+}
+
+FatTable::fat_page *
+FatTable::page(unsigned page_no)
+{
+    if (page_no == last_page_no)
+        return last_page;
+
+    auto it = pages.find(page_no);
+    if (it != pages.end()) {
+        lru.splice(lru.begin(), lru, it->second.pos);
+        last_page_no = page_no;
+        last_page = &it->second;
+        return last_page;
+    }
+
+    // make room by writing the least recently used page back to the cache
+    while (pages.size() >= max_pages) {
+        unsigned victim = lru.back();
+        fat_page &p = pages[victim];
+        if (p.dirty &&
+            cache.write(start_block + victim, reinterpret_cast<uint8_t*>(p.entries.data())) != 0)
+            return nullptr;
+        lru.pop_back();
+        pages.erase(victim);
+        if (victim == last_page_no) {
+            last_page_no = UINT32_MAX;
+            last_page = nullptr;
+        }
+    }
+
+    fat_page &p = pages[page_no];
+    p.entries.resize(per_page);
+    if (cache.read(start_block + page_no, reinterpret_cast<uint8_t*>(p.entries.data())) != 0) {
+        pages.erase(page_no);
+        return nullptr;
+    }
+    lru.push_front(page_no);
+    p.pos = lru.begin();
+    last_page_no = page_no;
+    last_page = &p;
+    return last_page;
+}
+
+// reads one entry, FAT_EOF if the index or the disk is bad
+int32_t
+FatTable::get(unsigned index)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (index >= no_entries) {
+        std::cout << "FatTable::get - ERROR: Invalid FAT index (" << index << ")\n";
+        return FAT_EOF;
+    }
+    fat_page *p = page(index / per_page);
+    if (p == nullptr)
+        return FAT_EOF;
+    return p->entries[index % per_page];
+}
+
+// changes one entry, it reaches the cache on flush()
+int
+FatTable::set(unsigned index, int32_t value)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (index >= no_entries) {
+        std::cout << "FatTable::set - ERROR: Invalid FAT index (" << index << ")\n";
+        return -1;
+    }
+    fat_page *p = page(index / per_page);
+    if (p == nullptr)
+        return -1;
+    p->entries[index % per_page] = value;
+    p->dirty = true;
+    if (track_free)
+        mark_free(index, value == FAT_FREE);
+    return 0;
+}
+
+// frees one entry but leaves the block out of the free-space bitmap until
+// release()
+int
+FatTable::free_later(unsigned index)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (index >= no_entries) {
+        std::cout << "FatTable::free_later - ERROR: Invalid FAT index (" << index << ")\n";
+        return -1;
+    }
+    fat_page *p = page(index / per_page);
+    if (p == nullptr)
+        return -1;
+    p->entries[index % per_page] = FAT_FREE;
+    p->dirty = true;
+    return 0;
+}
+
+// puts blocks freed with free_later() back into the free-space bitmap
+void
+FatTable::release(const std::vector<int> &blocks)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (int b : blocks) {
+        if (!track_free || b < 0 || (unsigned)b >= no_entries)
+            continue;
+        fat_page *p = page((unsigned)b / per_page);
+        if (p != nullptr && p->entries[(unsigned)b % per_page] == FAT_FREE)
+            mark_free((unsigned)b, true);
+    }
+}
+
+// writes the dirty pages to the block cache
+int
+FatTable::flush()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int ret = 0;
+    for (auto &[page_no, p] : pages) {
+        if (!p.dirty)
+            continue;
+        if (cache.write(start_block + page_no, reinterpret_cast<uint8_t*>(p.entries.data())) != 0) {
+            ret = -1;
+            continue;
+        }
+        p.dirty = false;
+    }
+    return ret;
+}
+
+// drops all resident pages without writing them
+void
+FatTable::reset()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    pages.clear();
+    lru.clear();
+    last_page_no = UINT32_MAX;
+    last_page = nullptr;
+}
+
+// number of free blocks in a row starting at start, at most max
+unsigned
+FatTable::free_run(unsigned start, unsigned max)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    unsigned n = 0;
+    unsigned i = start;
+    while (n < max && i < no_entries) {
+        // the used blocks of this word from i onwards
+        uint64_t used = ~free_bits[i / 64] >> (i % 64);
+        unsigned run = (used == 0) ? 64 - i % 64 : (unsigned)__builtin_ctzll(used);
+        n += run;
+        i += run;
+        if (used != 0)
+            break;
+    }
+    return std::min({n, max, no_entries - start});
+}
+
+// number of free blocks among the count blocks starting at start
+unsigned
+FatTable::count_free(unsigned start, unsigned count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    unsigned end = std::min(start + count, no_entries);
+    unsigned n = 0;
+    for (unsigned i = start; i < end;) {
+        unsigned bits = std::min(64 - i % 64, end - i);
+        uint64_t mask = (bits == 64) ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1);
+        n += __builtin_popcountll((free_bits[i / 64] >> (i % 64)) & mask);
+        i += bits;
+    }
+    return n;
+}
@@ -0,0 +1,94 @@
+// fat.h is the header file for the FatTable class. It gives access to the
+// on-disk FAT one page (block) at a time instead of holding it all in memory.
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "cache.h"
+
+#ifndef __FAT_H__
+#define __FAT_H__
+
+#define FAT_FREE 0
+#define FAT_EOF -1
+
+// FAT entries are 32 bits wide, a FAT page is one block of them
+#define FAT_ENTRY_SIZE 4
+// default number of FAT pages kept in memory (4 MiB of FAT covers 4 GiB of
+// volume with 4 KiB blocks)
+#define FAT_CACHE_PAGES 1024
+
+class FatTable {
+private:
+    struct fat_page {
+        std::vector<int32_t> entries;
+        bool dirty = false;
+        std::list<unsigned>::iterator pos;
+    };
+
+    BlockCache &cache;
+    unsigned start_block = 0; // first block of the FAT on disk
+    unsigned no_entries = 0;  // one entry per block of the volume
+    unsigned per_page = 0;    // entries per FAT block
+    unsigned max_pages;
+    bool track_free; // keeps the free-space bitmap below
+
+    std::unordered_map<unsigned, fat_page> pages;
+    std::list<unsigned> lru; // front = most recently used page
+    // the last page used, most lookups hit the same page again
+    unsigned last_page_no = UINT32_MAX;
+    fat_page *last_page = nullptr;
+
+    // free-space bitmap, bit i of word i / 64 is set if block i is free.
+    // It follows every set() so allocation never has to scan the FAT.
+    std::vector<uint64_t> free_bits;
+    unsigned no_free = 0;
+    // no word before this one has a free bit
+    unsigned first_free_word = 0;
+    void mark_free(unsigned index, bool free);
+
+    // every call may come from several threads. A caller that looks for free
+    // blocks and then takes them needs a lock of its own around both.
+    std::mutex lock;
+
+    // returns the page holding entries [page_no * per_page, ...),
+    // reading it from disk if it is not resident
+    fat_page *page(unsigned page_no);
+
+public:
+    // A table that is not a FAT (e.g. the block reference counts) can do
+    // without the free-space bitmap, then attach does not scan it.
+    FatTable(BlockCache &cache, unsigned max_pages = FAT_CACHE_PAGES, bool track_free = true);
+    // sets the FAT location and size for the current block size, dropping
+    // all resident pages. A FAT that is known to be all free (just formatted)
+    // needs no scan to build the free-space bitmap.
+    void attach(unsigned start_block, unsigned no_entries, bool all_free = false);
+    unsigned get_no_entries() { return no_entries; }
+    // number of blocks the FAT of a volume with no_blocks blocks of
+    // block_size bytes needs
+    static unsigned blocks_for(unsigned no_blocks, unsigned block_size);
+    // reads one entry, FAT_EOF if the index or the disk is bad
+    int32_t get(unsigned index);
+    // changes one entry, it reaches the cache on flush()
+    int set(unsigned index, int32_t value);
+    // frees one entry but leaves the block out of the free-space bitmap
+    // until release(), so it is not handed out again before the free is
+    // durable
+    int free_later(unsigned index);
+    // puts blocks freed with free_later() back into the free-space bitmap
+    void release(const std::vector<int> &blocks);
+    // writes the dirty pages to the block cache
+    int flush();
+    // drops all resident pages without writing them
+    void reset();
+    // returns the first free block at or after from, -1 if there is none
+    int find_free(unsigned from);
+    unsigned get_no_free();
+    // number of free blocks among the count blocks starting at start
+    unsigned count_free(unsigned start, unsigned count);
+    // number of free blocks in a row starting at start, at most max
+    unsigned free_run(unsigned start, unsigned max);
+};
+
+#endif // __FAT_H__
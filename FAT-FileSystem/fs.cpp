@@ -1,119 +1,1619 @@
 #include "fs.h"
 
-FS::FS()
+// ids of the FS instances, see thread_state
+static atomic<uint64_t> noInstances{0};
+
+FS::FS() : id(++noInstances)
 {
     cout << "Run help to see the available commands\n";
-    disk.read(ROOT_BLOCK, reinterpret_cast<uint8_t*>(root_dir));
-    disk.read(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat));
 
-    this->currentDir = "/";
-    this->currentBlock = 0;
-    this->current_directory_block = 0;
+    const char *env = getenv("FS_DURABILITY");
+    if (env != nullptr) {
+        string mode = env;
+        if (mode == "none") {
+            durability = DURABILITY_NONE;
+        } else if (mode == "periodic") {
+            durability = DURABILITY_PERIODIC;
+        } else if (mode != "op") {
+            cerr << "WARNING: Unknown durability mode '" << mode << "', using op\n";
+        }
+    }
+    env = getenv("FS_COMMIT_MS");
+    if (env != nullptr && atoi(env) > 0) {
+        commitInterval = chrono::milliseconds(atoi(env));
+    }
+    lastCommit = chrono::steady_clock::now();
+
+    // the superblock lives in the first DEFAULT_BLOCK_SIZE bytes whatever
+    // the block size of the volume is
+    vector<uint8_t> block(DEFAULT_BLOCK_SIZE);
+    cache.read(SUPER_BLOCK, block.data());
+    memcpy(&sb, block.data(), sizeof(sb));
+    if (!formatted()) {
+        cout << "No file system found on the disk, run format to create one\n";
+        memset(&sb, 0, sizeof(sb));
+    } else if (sb.block_size < MIN_BLOCK_SIZE || sb.block_size > MAX_BLOCK_SIZE ||
+               (sb.block_size & (sb.block_size - 1)) != 0 ||
+               (uint64_t)sb.no_blocks * sb.block_size > (uint64_t)disk.get_no_blocks() * disk.get_block_size() ||
+               sb.fat_start != FAT_BLOCK ||
+               sb.data_start != sb.fat_start + sb.fat_blocks + sb.ref_blocks + sb.journal_blocks ||
+               (sb.ref_blocks != 0 && sb.ref_start != sb.fat_start + sb.fat_blocks) ||
+               (sb.journal_blocks != 0 && (sb.journal_start != sb.fat_start + sb.fat_blocks + sb.ref_blocks ||
+                                           sb.journal_blocks < JOURNAL_MIN_BLOCKS)) ||
+               setBlockSize(sb.block_size) != 0) {
+        cerr << "[ERROR] The file system on the disk has an unsupported geometry, run format to replace it\n";
+        memset(&sb, 0, sizeof(sb));
+    } else {
+        // the records a crash left in the journal are replayed before
+        // anything else is read
+        if (sb.journal_blocks != 0) {
+            int replayed = journal.attach(sb.journal_start, sb.journal_blocks);
+            if (replayed < 0) {
+                cerr << "[ERROR] Could not replay the journal, the file system may be inconsistent\n";
+            } else if (replayed > 0) {
+                cout << "Recovered " << replayed << " transactions from the journal\n";
+            }
+        }
+        fat.attach(sb.fat_start, sb.no_blocks);
+        if (reflinks()) {
+            refs.attach(sb.ref_start, sb.no_blocks);
+        }
+        disk.set_layout(sb.fat_start, sb.data_start, sb.journal_blocks != 0 ? sb.journal_start : sb.data_start);
+    }
+    // the root directory is read once, from then on root_dir is the
+    // authoritative copy and reaches the disk at commit
+    root_dir.resize(dirSize);
+    if (formatted()) {
+        vector<int> chain = dirChain(ROOT_BLOCK);
+        root_dir.resize(chain.size() * dirSize);
+        for (size_t k = 0; k < chain.size(); k++) {
+            if (k > 0) {
+                disk.set_dir_block(chain[k], true);
+            }
+            cache.read(chain[k], reinterpret_cast<uint8_t*>(root_dir.data() + k * dirSize));
+        }
+    }
 }
 
 FS::~FS()
 {
+    unique_lock<shared_mutex> alone(volumeLock);
+    if (commit() == 0) {
+        journal.checkpoint();
+    }
+}
+
+// logs the FAT and all dirty blocks in the journal, or writes them back
+// when the volume has none, and flushes the disk
+int FS::commit()
+{
+    opsCommitted = opsDone.load();
+    lastCommit = chrono::steady_clock::now();
+    // only the FAT blocks changed since the last commit are written
+    int ret = fat.flush();
+    if (refs.flush() != 0) {
+        ret = -1;
+    }
+    if (!rootDirty.empty()) {
+        vector<int> chain = dirChain(ROOT_BLOCK);
+        for (int pos : rootDirty) {
+            if (pos < (int)chain.size() &&
+                cache.write(chain[pos], reinterpret_cast<uint8_t*>(root_dir.data() + (size_t)pos * dirSize)) != 0) {
+                ret = -1;
+            }
+        }
+        rootDirty.clear();
+    }
+    if (journal.commit() != 0 || ret != 0) {
+        return -1;
+    }
+    // the blocks this commit freed can go now that nothing on disk uses
+    // them, and only then be allocated again
+    vector<int> freed;
+    {
+        lock_guard<mutex> guard(allocLock);
+        freed.assign(freedBlocks.begin(), freedBlocks.end());
+        freedBlocks.clear();
+    }
+    this->discardBlocks(freed);
+    this->fat.release(freed);
+    return 0;
+}
+
+// called at the end of every modifying command, once it let go of
+// volumeLock. One thread at a time commits, and the commands that end
+// while it waits for the lock or commits wait for it, or for the next
+// commit if it started too early for them, so a commit covers every
+// command that ended before it. Blocks waiting for the journal cannot be
+// evicted, so a full cache commits early, and so does a volume that has
+// more blocks waiting to be released by a commit than free ones
+void FS::endOp(uint64_t done)
+{
+    bool held;
+    {
+        lock_guard<mutex> guard(allocLock);
+        held = !freedBlocks.empty() && this->fat.get_no_free() < freedBlocks.size();
+    }
+    if (durability != DURABILITY_OP && !held &&
+        (durability != DURABILITY_PERIODIC || chrono::steady_clock::now() - lastCommit.load() < commitInterval) &&
+        (!journal.active() || !cache.over_capacity())) {
+        return;
+    }
+    unique_lock<mutex> guard(commitLock);
+    while (opsCommitted < done) {
+        if (committing) {
+            commitDone.wait(guard);
+            continue;
+        }
+        committing = true;
+        guard.unlock();
+        {
+            unique_lock<shared_mutex> alone(volumeLock);
+            if (opsCommitted < done) {
+                commit();
+            }
+        }
+        guard.lock();
+        committing = false;
+        commitDone.notify_all();
+    }
+}
+
+FS::op_scope::op_scope(FS &fs, bool modifying, bool exclusive) : fs(fs), state(fs.self())
+{
+    if (state.depth++ == 0) {
+        if (exclusive) {
+            alone = unique_lock<shared_mutex>(fs.volumeLock);
+        } else {
+            shared = shared_lock<shared_mutex>(fs.volumeLock);
+        }
+    }
+    state.modified = state.modified || modifying;
+}
+
+FS::op_scope::~op_scope()
+{
+    if (--state.depth > 0) {
+        return;
+    }
+    bool modified = state.modified;
+    state.modified = false;
+    uint64_t done = ++fs.opsDone;
+    if (shared.owns_lock()) {
+        shared.unlock();
+    }
+    if (alone.owns_lock()) {
+        alone.unlock();
+    }
+    if (modified) {
+        fs.endOp(done);
+    }
+}
+
+FS::dir_guard::dir_guard(FS &fs, int block, bool exclusive, int block2, bool exclusive2,
+                         int block3, bool exclusive3)
+    : fs(fs)
+{
+    for (auto [b, excl] : {make_pair(block, exclusive), make_pair(block2, exclusive2), make_pair(block3, exclusive3)}) {
+        if (b < 0) {
+            continue;
+        }
+        auto it = find_if(held.begin(), held.end(), [b = b](const pair<int, bool> &h) { return h.first == b; });
+        if (it != held.end()) {
+            it->second = it->second || excl;
+        } else {
+            held.emplace_back(b, excl);
+        }
+    }
+    sort(held.begin(), held.end());
+    for (auto [b, excl] : held) {
+        if (excl) {
+            fs.dirLock(b).lock();
+        } else {
+            fs.dirLock(b).lock_shared();
+        }
+    }
+}
+
+void FS::dir_guard::release()
+{
+    for (auto it = held.rbegin(); it != held.rend(); ++it) {
+        if (it->second) {
+            fs.dirLock(it->first).unlock();
+        } else {
+            fs.dirLock(it->first).unlock_shared();
+        }
+    }
+    held.clear();
+}
+
+shared_mutex &FS::dirLock(int block)
+{
+    lock_guard<mutex> guard(dirLocksLock);
+    unique_ptr<shared_mutex> &l = dirLocks[block];
+    if (!l) {
+        l.reset(new shared_mutex());
+    }
+    return *l;
+}
+
+FS::thread_state &FS::self()
+{
+    thread_local unordered_map<uint64_t, thread_state> states;
+    thread_state &t = states[id];
+    if (t.formats != formats) {
+        t.dir = "/";
+        t.block = ROOT_BLOCK;
+        t.resolved = ROOT_BLOCK;
+        t.formats = formats;
+    }
+    return t;
+}
+
+// switches the disk, cache and directory size to a new block size
+int FS::setBlockSize(uint32_t block_size, unsigned no_blocks)
+{
+    fat.reset();
+    refs.reset();
+    freedBlocks.clear();
+    chains.clear();
+    rootDirty.clear();
+    dirIndex.clear();
+    dentries.clear();
+    noDentries = 0;
+    journal.detach();
+    if (disk.set_geometry(block_size, no_blocks) != 0) {
+        return -1;
+    }
+    // whatever the cache still holds was read with the old block size
+    cache.invalidate();
+    this->blockSize = (int)block_size;
+    this->dirSize = (int)(block_size / sizeof(dir_entry));
+    return 0;
+}
+
+// blocks of the directory starting at block, in chain order
+vector<int> FS::dirChain(int block)
+{
+    vector<int> chain{block};
+    int next = this->fat.get(block);
+    while (next >= (int)sb.data_start && next < (int)sb.no_blocks && chain.size() < sb.no_blocks) {
+        chain.push_back(next);
+        next = this->fat.get(next);
+    }
+    return chain;
+}
+
+// block of the directory chain that holds slot, -1 if it has no such slot
+int FS::slotBlock(int block, int slot)
+{
+    dir_index &index = indexFor(block);
+    if (slot < 0 || slot / dirSize >= (int)index.blocks.size()) {
+        return -1;
+    }
+    return index.blocks[slot / dirSize];
+}
+
+// reads count entries from slot on, all in the directory block holding slot
+int FS::readEntries(int block, int slot, int count, dir_entry *entries)
+{
+    if (block == ROOT_BLOCK) {
+        if (slot < 0 || slot + count > (int)root_dir.size()) {
+            return -1;
+        }
+        copy(root_dir.begin() + slot, root_dir.begin() + slot + count, entries);
+        return 0;
+    }
+    int b = slotBlock(block, slot);
+    if (b == -1 || slot % dirSize + count > dirSize) {
+        return -1;
+    }
+    vector<dir_entry> buf(dirSize);
+    if (this->cache.read(b, reinterpret_cast<uint8_t*>(buf.data())) != 0) {
+        return -1;
+    }
+    copy(buf.begin() + slot % dirSize, buf.begin() + slot % dirSize + count, entries);
+    return 0;
+}
+
+// calls fn with the entries of each block of the directory in turn
+int FS::streamDir(int block, const function<bool(const dir_entry *entries, int count)> &fn)
+{
+    if (block == ROOT_BLOCK) {
+        for (size_t first = 0; first < root_dir.size(); first += dirSize) {
+            if (!fn(root_dir.data() + first, dirSize)) {
+                break;
+            }
+        }
+        return 0;
+    }
+    vector<dir_entry> entries(dirSize);
+    for (int b : dirChain(block)) {
+        // a directory listed before it is indexed, a no-op once it is known
+        disk.set_dir_block(b, true);
+        if (this->cache.read(b, reinterpret_cast<uint8_t*>(entries.data())) != 0) {
+            return -1;
+        }
+        if (!fn(entries.data(), dirSize)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// writes a whole directory
+int FS::writeDir(int block, vector<dir_entry> &entries)
+{
+    if (entries.size() < (size_t)dirSize) {
+        entries.resize(dirSize);
+    }
+    dropIndex(block);
+    int nblocks = (int)(entries.size() / dirSize);
+    if (block == ROOT_BLOCK) {
+        root_dir = entries;
+        for (int k = 0; k < nblocks; k++) {
+            rootDirty.insert(k);
+        }
+        return 0;
+    }
+    vector<int> chain = dirChain(block);
+    for (int k = 0; k < nblocks && k < (int)chain.size(); k++) {
+        if (this->cache.write(chain[k], reinterpret_cast<uint8_t*>(entries.data() + (size_t)k * dirSize)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// writes the single entry in slot of a directory, only its block is touched
+int FS::writeEntry(int block, int slot, const dir_entry &entry)
+{
+    // the index knows the block of the slot, and slotChanged needs it built
+    int b = slotBlock(block, slot);
+    if (b == -1) {
+        return -1;
+    }
+    slotChanged(block, slot, entry);
+    if (block == ROOT_BLOCK) {
+        root_dir[slot] = entry;
+        rootDirty.insert(slot / dirSize);
+        return 0;
+    }
+    vector<dir_entry> entries(dirSize);
+    if (this->cache.read(b, reinterpret_cast<uint8_t*>(entries.data())) != 0) {
+        return -1;
+    }
+    entries[slot % dirSize] = entry;
+    return this->cache.write(b, reinterpret_cast<uint8_t*>(entries.data()));
+}
+
+// keeps the name index and the dentry cache in step with a slot change
+void FS::slotChanged(int block, int slot, const dir_entry &entry)
+{
+    lock_guard<recursive_mutex> guard(indexLock);
+    auto it = dirIndex.find(block);
+    if (it == dirIndex.end()) {
+        dropIndex(block);
+        return;
+    }
+    // the old and the new name of the slot are the only dentries that can
+    // have changed
+    auto cached = dentries.find(block);
+    if (cached != dentries.end()) {
+        noDentries -= cached->second.erase(it->second.names[slot]);
+        noDentries -= cached->second.erase(string(entry.file_name, strnlen(entry.file_name, sizeof(entry.file_name))));
+    }
+    indexSlot(it->second, slot, entry);
+}
+
+// adds an empty block to the end of the directory, next to its last block
+// if that one is free
+int FS::growDir(int block)
+{
+    dir_index &index = indexFor(block);
+    int tail = index.blocks.back();
+    int goal = (tail >= (int)sb.data_start) ? tail + 1 : -1;
+    int added = this->allocateChain(1, goal, block);
+    if (added == -1) {
+        return -1;
+    }
+    this->fat.set(tail, added);
+
+    int first = (int)index.blocks.size() * dirSize;
+    disk.set_dir_block(added, true);
+    if (block == ROOT_BLOCK) {
+        root_dir.resize(first + dirSize, dir_entry());
+        rootDirty.insert(first / dirSize);
+    } else {
+        vector<dir_entry> entries(dirSize, dir_entry());
+        this->cache.write(added, reinterpret_cast<uint8_t*>(entries.data()));
+    }
+
+    lock_guard<recursive_mutex> guard(indexLock);
+    index.blocks.push_back(added);
+    index.names.resize(first + dirSize);
+    for (int i = first; i < first + dirSize; i++) {
+        index.free_slots.insert(i);
+    }
+    return first;
+}
 
+FS::dir_index &FS::indexFor(int block)
+{
+    {
+        lock_guard<recursive_mutex> guard(indexLock);
+        auto it = dirIndex.find(block);
+        if (it != dirIndex.end()) {
+            return it->second;
+        }
+    }
+    // built from the directory blocks outside indexLock. The caller holds
+    // the directory's lock, so no one changes it meanwhile.
+    dir_index index;
+    index.blocks = dirChain(block);
+    index.names.resize(index.blocks.size() * dirSize);
+    vector<dir_entry> entries(dirSize);
+    for (size_t k = 0; k < index.blocks.size(); k++) {
+        const dir_entry *part = root_dir.data() + k * dirSize;
+        if (block != ROOT_BLOCK) {
+            disk.set_dir_block(index.blocks[k], true);
+            this->cache.read(index.blocks[k], reinterpret_cast<uint8_t*>(entries.data()));
+            part = entries.data();
+        }
+        for (int i = 0; i < dirSize; i++) {
+            int slot = (int)k * dirSize + i;
+            index.free_slots.insert(slot);
+            indexSlot(index, slot, part[i]);
+        }
+    }
+    lock_guard<recursive_mutex> guard(indexLock);
+    return dirIndex.emplace(block, move(index)).first->second;
+}
 
+// brings the index entry of one slot in line with its directory entry
+void FS::indexSlot(dir_index &index, int slot, const dir_entry &entry)
+{
+    string &old = index.names[slot];
+    if (!old.empty()) {
+        auto it = index.slots.find(old);
+        if (it != index.slots.end() && it->second == slot) {
+            index.slots.erase(it);
+        }
+    }
+    for (auto it = index.subdirs.begin(); it != index.subdirs.end(); ++it) {
+        if (it->second == slot) {
+            index.subdirs.erase(it);
+            break;
+        }
+    }
+    // the slots holding inline data have no name
+    old = (entry.file_name[0] == INLINE_MARK) ? string() : string(entry.file_name, strnlen(entry.file_name, sizeof(entry.file_name)));
+    if (!old.empty()) {
+        index.slots[old] = slot;
+        if (entry.type == TYPE_DIR && old != "..") {
+            index.subdirs[entry.first_blk] = slot;
+        }
+    }
+    if (entry.file_name[0] == '\0' && entry.first_blk == 0) {
+        index.free_slots.insert(slot);
+    } else {
+        index.free_slots.erase(slot);
+    }
+}
+
+// forgets the name index and the cached dentries of a freed directory block
+void FS::dropIndex(int block)
+{
+    lock_guard<recursive_mutex> guard(indexLock);
+    dirIndex.erase(block);
+    auto cached = dentries.find(block);
+    if (cached != dentries.end()) {
+        noDentries -= cached->second.size();
+        dentries.erase(cached);
+    }
+}
+
+// looks name up in the dentry cache of a directory block, child is set to
+// the directory it names or to -1 for a negative entry
+bool FS::lookupDentry(int block, const string &name, int &child)
+{
+    lock_guard<recursive_mutex> guard(indexLock);
+    auto cached = dentries.find(block);
+    if (cached == dentries.end()) {
+        return false;
+    }
+    auto it = cached->second.find(name);
+    if (it == cached->second.end()) {
+        return false;
+    }
+    child = it->second;
+    return true;
+}
+
+void FS::addDentry(int block, const string &name, int child)
+{
+    lock_guard<recursive_mutex> guard(indexLock);
+    // a full cache simply starts over
+    if (noDentries >= DENTRY_CACHE_MAX) {
+        dentries.clear();
+        noDentries = 0;
+    }
+    if (dentries[block].emplace(name, child).second) {
+        noDentries++;
+    }
+}
+
+// slot of the entry called name in the directory block, -1 if none
+int FS::findEntry(int block, const string &name)
+{
+    if (name.empty()) {
+        return -1;
+    }
+    dir_index &index = indexFor(block);
+    auto it = index.slots.find(name);
+    return (it == index.slots.end()) ? -1 : it->second;
+}
+
+// lowest free slot of the directory, which grows by a block when it is full
+int FS::findFreeSlot(int block)
+{
+    dir_index &index = indexFor(block);
+    return index.free_slots.empty() ? growDir(block) : *index.free_slots.begin();
+}
+
+// slot of the sub-directory starting at child, -1 if none
+int FS::findSubdir(int block, int child)
+{
+    dir_index &index = indexFor(block);
+    auto it = index.subdirs.find((uint32_t)child);
+    return (it == index.subdirs.end()) ? -1 : it->second;
+}
+
+// reads the entry in slot, only the directory block that holds it
+int FS::readEntry(int block, int slot, dir_entry &entry)
+{
+    return readEntries(block, slot, 1, &entry);
+}
+
+// the data of the inline file of size bytes in slot, from the slots after it
+string FS::readInline(int block, int slot, uint32_t size)
+{
+    string data;
+    int count = min(inlineSlots(size), dirSize - 1 - slot % dirSize);
+    vector<dir_entry> parts(max(count, 0));
+    if (count > 0 && readEntries(block, slot + 1, count, parts.data()) == 0) {
+        for (int k = 0; k < count && data.size() < size; k++) {
+            const char *bytes = reinterpret_cast<const char*>(&parts[k]);
+            data.append(bytes + 1, min<size_t>(INLINE_SLOT_BYTES, size - data.size()));
+        }
+    }
+    data.resize(size, '\0');
+    return data;
+}
+
+// writes the entry of an inline file to slot and its data to the slots
+// after it
+int FS::writeInline(int block, int slot, const dir_entry &entry, const string &data)
+{
+    int ret = this->writeEntry(block, slot, entry);
+    for (int k = 0; k < inlineSlots((uint32_t)data.size()); k++) {
+        dir_entry part;
+        memset(&part, 0, sizeof(part));
+        char *bytes = reinterpret_cast<char*>(&part);
+        bytes[0] = INLINE_MARK;
+        data.copy(bytes + 1, INLINE_SLOT_BYTES, (size_t)k * INLINE_SLOT_BYTES);
+        if (this->writeEntry(block, slot + 1 + k, part) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+// empties count slots from slot on
+void FS::clearSlots(int block, int slot, int count)
+{
+    dir_entry empty;
+    memset(&empty, 0, sizeof(empty));
+    for (int k = 0; k < count; k++) {
+        this->writeEntry(block, slot + k, empty);
+    }
+}
+
+// lowest slot starting count free slots in one directory block
+int FS::findFreeRun(int block, int count)
+{
+    dir_index &index = indexFor(block);
+    int start = -1;
+    int prev = -2;
+    for (int slot : index.free_slots) {
+        if (slot != prev + 1 || slot % dirSize == 0) {
+            start = slot;
+        }
+        prev = slot;
+        if (slot - start + 1 == count) {
+            return start;
+        }
+    }
+    return (count <= dirSize) ? growDir(block) : -1;
+}
+
+// formats the disk, i.e., creates an empty file system
+int FS::format(uint64_t volume_size, uint32_t block_size) {
+
+    op_scope op{*this, false, true};
+    if (block_size == 0) {
+        block_size = (uint32_t)blockSize;
+    }
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        cerr << "[ERROR] The block size must be a power of two between " << MIN_BLOCK_SIZE << " and "
+             << MAX_BLOCK_SIZE << " bytes.\n";
+        return -1;
+    }
+    uint64_t no_blocks = (volume_size == 0) ? disk.get_disk_size() / block_size : volume_size / block_size;
+    if (no_blocks < MIN_NO_BLOCKS || no_blocks > INT32_MAX) {
+        cerr << "[ERROR] The volume must be between " << MIN_NO_BLOCKS << " and " << INT32_MAX
+             << " blocks of " << block_size << " bytes.\n";
+        return -1;
+    }
+
+    if (setBlockSize(block_size, (unsigned)no_blocks) != 0) {
+        return -1;
+    }
+
+    // Start by zeroing out the whole thing. The image is punched into one
+    // hole, so only the metadata written below takes up space
+    if (disk.discard(0, (unsigned)no_blocks) != 0) {
+        return -1;
+    }
+
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = FS_MAGIC;
+    sb.version = FS_VERSION;
+    sb.block_size = block_size;
+    sb.no_blocks = (uint32_t)no_blocks;
+    sb.fat_start = FAT_BLOCK;
+    sb.fat_blocks = FatTable::blocks_for(sb.no_blocks, sb.block_size);
+    sb.ref_start = sb.fat_start + sb.fat_blocks;
+    sb.ref_blocks = FatTable::blocks_for(sb.no_blocks, sb.block_size);
+    sb.journal_start = sb.ref_start + sb.ref_blocks;
+    sb.journal_blocks = Journal::blocks_for(sb.no_blocks, sb.block_size);
+    sb.data_start = sb.journal_start + sb.journal_blocks;
+
+    // Get FAT ready, it is all free after zeroing. Mark the superblock, the
+    // root directory, the FAT, the reference counts and the journal as
+    // reserved
+    fat.attach(sb.fat_start, sb.no_blocks, true);
+    refs.attach(sb.ref_start, sb.no_blocks, true);
+    disk.set_layout(sb.fat_start, sb.data_start, sb.journal_start);
+    for (unsigned i = 0; i < sb.data_start; i++) {
+        fat.set(i, FAT_EOF);
+    }
+
+    root_dir.assign(dirSize, dir_entry());
+    this->writeDir(ROOT_BLOCK, root_dir);
+
+    vector<uint8_t> block(blockSize, 0);
+    memcpy(block.data(), &sb, sizeof(sb));
+    cache.write(SUPER_BLOCK, block.data());
+    // the new metadata is written in place, the journal starts empty
+    if (commit() != 0 || journal.format(sb.journal_start, sb.journal_blocks) != 0) {
+        return -1;
+    }
+
+    // every thread starts over in the root directory
+    formats++;
+    return 0;
+}
+
+// returns the first free block at or after from, -1 if there is none
+int FS::findFreeBlock(int from)
+{
+    if (from < (int)sb.data_start) {
+        from = sb.data_start;
+    }
+    // the FAT keeps a free-space bitmap, no scan needed
+    return this->fat.find_free((unsigned)from);
+}
+
+// the data area is split into groups of groupBlocks() blocks, group g
+// starts at block data_start + g * groupBlocks()
+int FS::groupOf(int block)
+{
+    return (block - (int)sb.data_start) / groupBlocks();
+}
+
+// returns a block for a new directory in the group with the most free
+// blocks, so directories spread over the volume, -1 if the volume is full
+int FS::allocateDirBlock()
+{
+    lock_guard<mutex> guard(allocLock);
+    int groups = (int)((sb.no_blocks - sb.data_start + groupBlocks() - 1) / groupBlocks());
+    int bestGroup = -1;
+    unsigned bestFree = 0;
+    for (int g = 0; g < groups; g++) {
+        unsigned n = this->fat.count_free(sb.data_start + g * groupBlocks(), groupBlocks());
+        if (n > bestFree) {
+            bestGroup = g;
+            bestFree = n;
+        }
+    }
+    if (bestGroup == -1) {
+        return -1;
+    }
+    int block = this->findFreeBlock(sb.data_start + bestGroup * groupBlocks());
+    this->fat.set(block, FAT_EOF);
+    disk.set_dir_block(block, true);
+    return block;
+}
+
+// finds the smallest free extent of at least needed blocks in [from, to),
+// -1 if there is none. All extents seen are added to seen if it is given.
+int FS::bestFit(int from, int to, int needed, vector<pair<int, int>> *seen)
+{
+    int bestStart = -1;
+    int bestLen = 0;
+    int pos = from;
+    while (pos < to) {
+        int start = this->fat.find_free(pos);
+        if (start == -1 || start >= to) {
+            break;
+        }
+        int len = (int)this->fat.free_run(start, to - start);
+        pos = start + len;
+        if (seen != nullptr) {
+            seen->push_back(make_pair(start, len));
+        }
+        if (len >= needed && (bestStart == -1 || len < bestLen)) {
+            bestStart = start;
+            bestLen = len;
+            if (len == needed) {
+                break;
+            }
+        }
+    }
+    return bestStart;
+}
+
+// allocates nblocks blocks as a new FAT chain ending in FAT_EOF and returns
+// its first block, -1 if there is not enough space. If goal is free the
+// chain starts there (appends continue right after the tail). The rest
+// comes from the smallest free extent that holds it, in the group of the
+// block near if possible (the file's directory) and else anywhere. Without
+// such an extent the largest extents are used first, so the file has as few
+// fragments as possible.
+int FS::allocateChain(int nblocks, int goal, int near)
+{
+    lock_guard<mutex> guard(allocLock);
+    if (nblocks <= 0 || this->fat.get_no_free() < (unsigned)nblocks) {
+        return -1;
+    }
+
+    // extents are linked to the chain as soon as they are picked, which also
+    // takes them out of the free-space bitmap for the next search
+    int first = -1;
+    int prev = -1;
+    int needed = nblocks;
+    auto take = [&](int start, int len) {
+        for (int b = start; b < start + len; b++) {
+            this->fat.set(b, FAT_EOF);
+            if (prev == -1) {
+                first = b;
+            } else {
+                this->fat.set(prev, b);
+            }
+            prev = b;
+        }
+        needed -= len;
+    };
+
+    if (goal >= (int)sb.data_start && goal < (int)sb.no_blocks) {
+        int len = (int)this->fat.free_run(goal, needed);
+        if (len > 0) {
+            take(goal, len);
+        }
+    }
+
+    if (needed > 0 && near >= 0 && near < (int)sb.no_blocks) {
+        // the root directory lives before the data area, its group is the first
+        int groupStart = sb.data_start + groupOf(max(near, (int)sb.data_start)) * groupBlocks();
+        int groupEnd = min((int)sb.no_blocks, groupStart + groupBlocks());
+        int start = bestFit(groupStart, groupEnd, needed, nullptr);
+        if (start != -1) {
+            take(start, needed);
+        }
+    }
+
+    if (needed > 0) {
+        vector<pair<int, int>> extents;
+        int start = bestFit(sb.data_start, sb.no_blocks, needed, &extents);
+        if (start != -1) {
+            take(start, needed);
+        } else {
+            sort(extents.begin(), extents.end(), [](const pair<int, int> &a, const pair<int, int> &b) {
+                return a.second > b.second;
+            });
+            for (auto [extentStart, len] : extents) {
+                if (needed == 0) {
+                    break;
+                }
+                take(extentStart, min(len, needed));
+            }
+        }
+    }
+    return first;
+}
+
+// number of runs of consecutive blocks the chain starting at first_blk has
+int FS::countFragments(int first_blk)
+{
+    int fragments = 0;
+    int prev = -2;
+    int block = first_blk;
+    while (block >= (int)sb.data_start && block < (int)sb.no_blocks) {
+        if (block != prev + 1) {
+            fragments++;
+        }
+        prev = block;
+        block = this->fat.get(block);
+    }
+    return fragments;
+}
+
+int FS::resolvePathToDirectory(const string &path){
+        op_scope op{*this, false};
+        thread_state &t = self();
+            if (path.empty()) {
+            return t.block;
+        }
+
+        int startBlock = (path[0] == '/') ? ROOT_BLOCK : t.block;
+
+        stringstream ss(path);
+        string token;
+        int dirBlock = startBlock;
+
+        while (getline(ss, token, '/')) {
+            if (token.empty()) {
+                continue;
+            }
+
+            int next = this->subdirNamed(dirBlock, token);
+
+            if (next == -1) {
+                if (token == "..") {
+                    cerr << "[ERROR] Could not find parent directory.\n";
+                } else {
+                    cerr << "[ERROR] Directory '" << token << "' not found.\n";
+                }
+                return -1;
+            }
+            dirBlock = next;
+        }
+        t.resolved = dirBlock;
+        return dirBlock;
+}
+
+// block of the sub-directory called name, -1 if there is none. The
+// directory block is only read when the dentry cache does not know the
+// name yet.
+int FS::subdirNamed(int block, const string &name)
+{
+    shared_lock<shared_mutex> guard(dirLock(block));
+    int child;
+    if (!this->lookupDentry(block, name, child)) {
+        int i = this->findEntry(block, name);
+        dir_entry entry;
+        child = (i != -1 && this->readEntry(block, i, entry) == 0 && entry.type == TYPE_DIR) ? (int)entry.first_blk : -1;
+        this->addDentry(block, name, child);
+    }
+    return child;
+}
+
+// block of the parent of a directory, from its ".." entry, -1 if none
+int FS::parentOf(int block)
+{
+    shared_lock<shared_mutex> guard(dirLock(block));
+    int parent = -1;
+    this->streamDir(block, [&](const dir_entry *entries, int count) {
+        for (int i = 0; i < count; i++) {
+            if (strcmp(entries[i].file_name, "..") == 0 && entries[i].type == TYPE_DIR) {
+                parent = (int)entries[i].first_blk;
+                return false;
+            }
+        }
+        return true;
+    });
+    return parent;
+}
+
+// gives freed blocks back to the host file system, one hole per run of
+// consecutive blocks
+void FS::discardBlocks(vector<int> blocks)
+{
+    sort(blocks.begin(), blocks.end());
+    size_t i = 0;
+    while (i < blocks.size()) {
+        size_t j = i + 1;
+        while (j < blocks.size() && blocks[j] == blocks[j - 1] + 1) {
+            j++;
+        }
+        this->cache.discard(blocks[i], (unsigned)(j - i));
+        i = j;
+    }
+}
+
+// frees the chain starting at first_blk, its blocks are discarded after the
+// next commit. A block another file shares only loses a reference.
+void FS::freeChain(int first_blk)
+{
+    {
+        lock_guard<mutex> guard(chainLock);
+        chains.erase((uint32_t)first_blk);
+    }
+    lock_guard<mutex> guard(allocLock);
+    int block = first_blk;
+    while (block >= (int)sb.data_start && block < (int)sb.no_blocks && this->fat.get(block) != FAT_FREE) {
+        int next = this->fat.get(block);
+        int count = reflinks() ? this->refs.get(block) : 0;
+        if (count > 0) {
+            this->refs.set(block, count - 1);
+        } else {
+            this->fat.free_later(block);
+            freedBlocks.insert(block);
+        }
+        block = next;
+    }
+}
+
+FS::file_handle *FS::handleFor(int fd)
+{
+    lock_guard<mutex> guard(handleLock);
+    auto it = handles.find(fd);
+    return (it == handles.end()) ? nullptr : &it->second;
+}
+
+// true if a descriptor has the file in slot of the directory open
+bool FS::isOpen(int dirBlock, int slot)
+{
+    lock_guard<mutex> guard(handleLock);
+    return openFiles.count({dirBlock, slot}) != 0;
+}
+
+// opens the file called name in a directory. A file created here starts
+// out inline, on volumes that have inline files; otherwise it gets its
+// blocks with the first write, or one block at close if it stays empty.
+int FS::openEntry(int dirBlock, const string &name, int flags)
+{
+    dir_entry entry;
+    int slot = this->findEntry(dirBlock, name);
+    if (slot == -1) {
+        if ((flags & OPEN_CREATE) == 0 || name.empty() || name.length() > sizeof(entry.file_name) - 1) {
+            return -1;
+        }
+        slot = this->findFreeSlot(dirBlock);
+        if (slot == -1) {
+            return -1;
+        }
+        memset(&entry, 0, sizeof(dir_entry));
+        strncpy(entry.file_name, name.c_str(), sizeof(entry.file_name) - 1);
+        entry.type = TYPE_FILE;
+        entry.access_rights = READ | WRITE;
+        if (inlining()) {
+            entry.first_blk = INLINE_BLK;
+        }
+        this->writeEntry(dirBlock, slot, entry);
+    } else if (this->readEntry(dirBlock, slot, entry) != 0) {
+        return -1;
+    }
+
+    if (entry.type != TYPE_FILE ||
+        ((flags & OPEN_READ) != 0 && (entry.access_rights & READ) == 0) ||
+        ((flags & OPEN_WRITE) != 0 && (entry.access_rights & WRITE) == 0)) {
+        return -1;
+    }
+
+    // a file that is open already is shared, its entry may be newer than
+    // the one on disk
+    shared_ptr<open_file> file = make_shared<open_file>();
+    file->dirBlock = dirBlock;
+    file->slot = slot;
+    file->entry = entry;
+    if (entry.first_blk == INLINE_BLK) {
+        file->inlined = true;
+        file->data = readInline(dirBlock, slot, entry.size);
+        file->dataSlots = inlineSlots(entry.size);
+    }
+    {
+        lock_guard<mutex> guard(chainLock);
+        auto known = chains.find(entry.first_blk);
+        if (known != chains.end()) {
+            file->nblocks = known->second.nblocks;
+            file->last = known->second.last;
+            file->owned = known->second.owned;
+        }
+    }
+    lock_guard<mutex> guard(handleLock);
+    shared_ptr<open_file> &open = openFiles[{dirBlock, slot}];
+    if (!open) {
+        open = move(file);
+    }
+    open->refs++;
+    int fd = nextFd++;
+    handles[fd] = file_handle{open, flags};
+    return fd;
+}
+
+// what is remembered about the chain starting at first_blk, empty if
+// nothing is yet
+FS::chain_info &FS::chainFor(uint32_t first_blk)
+{
+    // a full cache simply starts over
+    if (chains.size() >= CHAIN_CACHE_MAX && chains.count(first_blk) == 0) {
+        chains.clear();
+    }
+    return chains[first_blk];
+}
+
+// remembers the chain of a handle for the next open of the file
+void FS::rememberChain(const open_file &f)
+{
+    if (f.nblocks <= 0) {
+        return;
+    }
+    lock_guard<mutex> guard(chainLock);
+    chain_info &c = chainFor(f.entry.first_blk);
+    c.nblocks = f.nblocks;
+    c.last = f.last;
+    c.owned = f.owned;
+}
+
+// block at position idx of the file's chain, -1 past its end. The cursor
+// makes sequential access one FAT lookup per block, and the last block is
+// known without a walk once the chain length is. Any other position is
+// reached from the closest sample of the chain before it.
+int FS::blockAt(open_file &f, uint32_t idx)
+{
+    if (f.nblocks > 0 && idx == (uint32_t)f.nblocks - 1) {
+        f.curBlock = f.last;
+        f.curIdx = idx;
+        return f.last;
+    }
+    if (f.curBlock == -1 || idx < f.curIdx || idx - f.curIdx >= CHAIN_SKIP) {
+        lock_guard<mutex> guard(chainLock);
+        auto known = chains.find(f.entry.first_blk);
+        if (known != chains.end() && !known->second.skip.empty()) {
+            const vector<int> &skip = known->second.skip;
+            uint32_t j = min(idx / CHAIN_SKIP, (uint32_t)skip.size() - 1);
+            if (f.curBlock == -1 || idx < f.curIdx || j * CHAIN_SKIP > f.curIdx) {
+                f.curBlock = skip[j];
+                f.curIdx = j * CHAIN_SKIP;
+            }
+        }
+    }
+    if (f.curBlock == -1 || idx < f.curIdx) {
+        f.curBlock = (int)f.entry.first_blk;
+        f.curIdx = 0;
+        if (f.curBlock < (int)sb.data_start || f.curBlock >= (int)sb.no_blocks) {
+            f.curBlock = -1;
+            return -1;
+        }
+    }
+    while (f.curIdx < idx) {
+        int next = this->fat.get(f.curBlock);
+        if (next < (int)sb.data_start || next >= (int)sb.no_blocks) {
+            return -1;
+        }
+        f.curBlock = next;
+        f.curIdx++;
+        // samples are taken in chain order by walks that pass them
+        if (f.curIdx % CHAIN_SKIP == 0) {
+            lock_guard<mutex> guard(chainLock);
+            vector<int> &skip = chainFor(f.entry.first_blk).skip;
+            if (skip.empty()) {
+                skip.push_back((int)f.entry.first_blk);
+            }
+            if (f.curIdx / CHAIN_SKIP == skip.size()) {
+                skip.push_back(f.curBlock);
+            }
+        }
+    }
+    return f.curBlock;
+}
+
+// makes the file's chain at least nblocks long
+int FS::reserve(open_file &f, int nblocks)
+{
+    if (f.inlined) {
+        if (nblocks == 0) {
+            return 0;
+        }
+        if (spill(f) != 0) {
+            return -1;
+        }
+    }
+    if (f.nblocks == -1) {
+        // walk the chain once for its length and its last block
+        f.nblocks = 0;
+        int block = (int)f.entry.first_blk;
+        while (block >= (int)sb.data_start && block < (int)sb.no_blocks) {
+            f.last = block;
+            f.nblocks++;
+            block = this->fat.get(block);
+        }
+    }
+    if (f.nblocks >= nblocks) {
+        rememberChain(f);
+        return 0;
+    }
+    // a shared tail is copied before the chain grows past it
+    if (f.nblocks > 0 && reflinks() && this->refs.get(f.last) > 0 &&
+        unshare(f, f.nblocks - 1) != 0) {
+        return -1;
+    }
+
+    int needed = nblocks - f.nblocks;
+    if (f.nblocks == 0) {
+        int first = this->allocateChain(needed, -1, f.dirBlock);
+        if (first == -1) {
+            return -1;
+        }
+        f.entry.first_blk = (uint32_t)first;
+        f.curBlock = -1;
+        f.last = first;
+    } else {
+        // continue right after the tail if that block is free
+        int first = this->allocateChain(needed, f.last + 1, f.dirBlock);
+        if (first == -1) {
+            return -1;
+        }
+        this->fat.set(f.last, first);
+        // the cursor waits at the old tail, so that writing the new blocks
+        // does not walk the chain from its start
+        f.curBlock = f.last;
+        f.curIdx = (uint32_t)f.nblocks - 1;
+        f.last = first;
+    }
+    while (this->fat.get(f.last) != FAT_EOF) {
+        f.last = this->fat.get(f.last);
+    }
+    // new blocks belong to this file alone
+    if (f.owned == (uint32_t)f.nblocks) {
+        f.owned = (uint32_t)nblocks;
+    }
+    f.nblocks = nblocks;
+    f.dirty = true;
+    rememberChain(f);
+    return 0;
 }
 
-// formats the disk, i.e., creates an empty file system
-int FS::format() {
-
-    // Start by zeroing out the whole thing
-    uint8_t zero_block[BLOCK_SIZE] = {0};
-
-    for (int i = 0; i < 2048; i++) {
-        disk.write(i, zero_block); 
+// Gives the file its own copy of the shared blocks up to position upto.
+// The copies replace the blocks from the first shared one on, as the block
+// before it has to point somewhere else; the blocks after upto stay shared.
+int FS::unshare(open_file &f, int upto, int skipFrom, int skipTo)
+{
+    if (!reflinks() || upto < (int)f.owned) {
+        return 0;
     }
-
-    const int fat_entries = BLOCK_SIZE / 2;
-
-    // Get FAT ready
-    for (int i = 0; i < fat_entries; i++) {
-        fat[i] = FAT_FREE;
+    int first = (int)f.owned;
+    while (first <= upto) {
+        int block = blockAt(f, (uint32_t)first);
+        if (block == -1) {
+            return -1;
+        }
+        if (this->refs.get(block) > 0) {
+            break;
+        }
+        first++;
+    }
+    if (first > upto) {
+        f.owned = (uint32_t)upto + 1;
+        rememberChain(f);
+        return 0;
     }
 
-    // Mark ROOT_BLOCK and FAT_BLOCK as reserved each entry is only 2 bytes.
-    fat[ROOT_BLOCK] = FAT_EOF;
-    fat[FAT_BLOCK] = FAT_EOF;  
+    int prev = (first == 0) ? -1 : blockAt(f, (uint32_t)first - 1);
+    vector<int> old;
+    for (int idx = first; idx <= upto; idx++) {
+        int block = blockAt(f, (uint32_t)idx);
+        if (block == -1) {
+            return -1;
+        }
+        old.push_back(block);
+    }
+    int next = this->fat.get(old.back());
+    int copy = this->allocateChain((int)old.size(), (prev == -1) ? -1 : prev + 1, f.dirBlock);
+    if (copy == -1) {
+        return -1;
+    }
 
-    disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat));
+    vector<uint8_t> data(blockSize);
+    int block = copy;
+    int ret = 0;
+    for (size_t k = 0; k < old.size(); k++) {
+        int idx = first + (int)k;
+        if ((idx < skipFrom || idx >= skipTo) &&
+            (this->cache.read(old[k], data.data()) != 0 || this->cache.write(block, data.data()) != 0)) {
+            ret = -1;
+        }
+        if (k + 1 < old.size()) {
+            block = this->fat.get(block);
+        }
+    }
+    {
+        lock_guard<mutex> guard(allocLock);
+        for (int b : old) {
+            this->refs.set(b, this->refs.get(b) - 1);
+        }
+    }
+    // the copy takes the place of the old blocks in this chain only
+    this->fat.set(block, next);
+    if (prev == -1) {
+        f.entry.first_blk = (uint32_t)copy;
+        f.dirty = true;
+    } else {
+        this->fat.set(prev, copy);
+        // the samples from the first copied block on are gone
+        lock_guard<mutex> guard(chainLock);
+        vector<int> &skip = chainFor(f.entry.first_blk).skip;
+        skip.resize(min(skip.size(), (size_t)((first + CHAIN_SKIP - 1) / CHAIN_SKIP)));
+    }
+    if (next == FAT_EOF) {
+        f.last = block;
+    }
+    f.curBlock = -1;
+    f.owned = (uint32_t)upto + 1;
+    rememberChain(f);
+    return ret;
+}
 
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        memset(root_dir[i].file_name, 0, sizeof(root_dir[i].file_name));
-        root_dir[i].size = 0;
-        root_dir[i].first_blk = 0;
-        root_dir[i].type = TYPE_FILE;        
-        root_dir[i].access_rights = 0;       
+// moves the data of an inline file into a chain of its own. The slots it
+// took are emptied when the entry is written back.
+int FS::spill(open_file &f)
+{
+    string data = move(f.data);
+    f.inlined = false;
+    f.data.clear();
+    f.entry.first_blk = 0;
+    f.nblocks = 0;
+    f.last = -1;
+    f.owned = 0;
+    f.curBlock = -1;
+    f.dirty = true;
+    if (data.empty()) {
+        return 0;
     }
+    vector<uint8_t> block(blockSize, 0);
+    memcpy(block.data(), data.data(), data.size());
+    if (reserve(f, 1) != 0 || this->cache.write((int)f.entry.first_blk, block.data()) != 0) {
+        this->freeChain((int)f.entry.first_blk);
+        f.inlined = true;
+        f.data = move(data);
+        f.entry.first_blk = INLINE_BLK;
+        f.nblocks = -1;
+        return -1;
+    }
+    return 0;
+}
 
-    disk.write(ROOT_BLOCK, reinterpret_cast<uint8_t*>(root_dir));
-    
-    this->currentDir = "/";
-    this->currentBlock = 0;
-    this->current_directory_block = 0;
+// gets the file ready to grow to size bytes
+int FS::preallocate(int fd, uint32_t size)
+{
+    file_handle *h = handleFor(fd);
+    if (h == nullptr) {
+        return -1;
+    }
+    open_file &f = *h->file;
+    lock_guard<mutex> guard(f.lock);
+    if (f.inlined && size <= INLINE_MAX) {
+        return 0;
+    }
+    return reserve(f, max(1, (int)((size + blockSize - 1) / blockSize)));
+}
 
+// stores an inline file in its directory, in place if the slots after the
+// entry are free and otherwise where there is room for all of it
+int FS::storeInline(open_file &f)
+{
+    dir_index &index = indexFor(f.dirBlock);
+    int need = inlineSlots(f.entry.size);
+    int slot = f.slot;
+    for (int k = f.dataSlots + 1; k <= need && slot != -1; k++) {
+        if ((f.slot + k) % dirSize == 0 || index.free_slots.count(f.slot + k) == 0) {
+            slot = -1;
+        }
+    }
+    if (slot == -1) {
+        slot = this->findFreeRun(f.dirBlock, need + 1);
+        if (slot == -1) {
+            return -1;
+        }
+        this->clearSlots(f.dirBlock, f.slot, 1 + f.dataSlots);
+        {
+            // the open file moves with its entry
+            lock_guard<mutex> guard(handleLock);
+            auto it = openFiles.find({f.dirBlock, f.slot});
+            shared_ptr<open_file> file = move(it->second);
+            openFiles.erase(it);
+            openFiles[{f.dirBlock, slot}] = move(file);
+        }
+        f.slot = slot;
+        f.dataSlots = 0;
+    }
+    f.entry.first_blk = INLINE_BLK;
+    if (this->writeInline(f.dirBlock, slot, f.entry, f.data) != 0) {
+        return -1;
+    }
+    f.dataSlots = max(f.dataSlots, need);
     return 0;
 }
 
-int FS::resolvePathToDirectory(const string &path){
-            if (path.empty()) {
-            return this->currentBlock;
-        }
+// opens the file <filepath>, creating it if asked to
+int FS::open(string filepath, int flags)
+{
+    op_scope op{*this, false};
+    string directoryPath;
+    string filename = filepath;
+    size_t lastSlash = filepath.find_last_of('/');
+    if (lastSlash != string::npos) {
+        directoryPath = (lastSlash == 0) ? "/" : filepath.substr(0, lastSlash);
+        filename = filepath.substr(lastSlash + 1);
+    }
+    int dirBlock = resolvePathToDirectory(directoryPath);
+    if (dirBlock == -1) {
+        return -1;
+    }
+    dir_guard dirs(*this, dirBlock, (flags & OPEN_CREATE) != 0);
+    return openEntry(dirBlock, filename, flags);
+}
 
-        int startBlock = (path[0] == '/') ? ROOT_BLOCK : this->currentBlock;
+// reads up to len bytes at the current position. Whole blocks go straight
+// into buf, one queued run per stretch of consecutive blocks; the partial
+// blocks at either end go through a block buffer.
+int64_t FS::read(int fd, uint8_t *buf, uint32_t len)
+{
+    op_scope op{*this, false};
+    file_handle *h = handleFor(fd);
+    if (h == nullptr || (h->flags & OPEN_READ) == 0) {
+        return -1;
+    }
+    open_file &f = *h->file;
+    lock_guard<mutex> guard(f.lock);
+    if (h->pos >= f.entry.size) {
+        return 0;
+    }
+    len = min(len, f.entry.size - h->pos);
+    if (f.inlined) {
+        memcpy(buf, f.data.data() + h->pos, len);
+        h->pos += len;
+        return len;
+    }
+
+    vector<uint8_t> partial;
+    uint32_t done = 0;
+    int ret = 0;
+    while (done < len && ret == 0) {
+        uint32_t idx = (h->pos + done) / blockSize;
+        uint32_t offset = (h->pos + done) % blockSize;
+        int block = blockAt(f, idx);
+        if (block == -1) {
+            ret = -1;
+            break;
+        }
+        if (offset == 0 && len - done >= (uint32_t)blockSize) {
+            uint32_t count = 1;
+            while ((int)count < maxRunBlocks() && len - done >= (count + 1) * blockSize &&
+                   blockAt(f, idx + count) == block + (int)count) {
+                count++;
+            }
+            ret = this->cache.submit_read_run(block, count, buf + done);
+            done += count * blockSize;
+        } else {
+            uint32_t n = min(len - done, (uint32_t)blockSize - offset);
+            partial.resize(blockSize);
+            ret = this->cache.read(block, partial.data());
+            memcpy(buf + done, partial.data() + offset, n);
+            done += n;
+        }
+    }
+    if (this->cache.wait_runs() != 0 || ret != 0) {
+        return -1;
+    }
+    h->pos += len;
+    return len;
+}
 
-        stringstream ss(path);
-        string token;
-        int dirBlock = startBlock;
+// writes len bytes at the current position, the file grows as needed.
+// Bytes of a partial block past the end of the file are zero filled.
+int64_t FS::write(int fd, const uint8_t *buf, uint32_t len)
+{
+    op_scope op{*this, false};
+    file_handle *h = handleFor(fd);
+    if (h == nullptr || (h->flags & OPEN_WRITE) == 0) {
+        return -1;
+    }
+    open_file &f = *h->file;
+    lock_guard<mutex> guard(f.lock);
+    if ((h->flags & OPEN_APPEND) != 0) {
+        h->pos = f.entry.size;
+    }
+    if ((uint64_t)h->pos + len > UINT32_MAX) {
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    uint32_t end = h->pos + len;
+    // an inline file changes in memory until close, or moves to a chain
+    // once it outgrows INLINE_MAX
+    if (f.inlined && end <= INLINE_MAX) {
+        if (end > f.data.size()) {
+            f.data.resize(end, '\0');
+            f.entry.size = end;
+        }
+        memcpy(&f.data[h->pos], buf, len);
+        h->pos = end;
+        f.dirty = true;
+        return len;
+    }
+    if (f.inlined && spill(f) != 0) {
+        return -1;
+    }
+    // shared blocks are copied before they are written, except for those
+    // the write covers completely
+    if (reserve(f, 0) != 0 ||
+        unshare(f, min((int)((end - 1) / blockSize), f.nblocks - 1),
+                (int)((h->pos + blockSize - 1) / blockSize), (int)(end / blockSize)) != 0 ||
+        reserve(f, (int)((end + blockSize - 1) / blockSize)) != 0) {
+        return -1;
+    }
 
-        while (getline(ss, token, '/')) {
-            if (token.empty()) {
-                continue;
+    vector<uint8_t> partial;
+    uint32_t done = 0;
+    int ret = 0;
+    while (done < len && ret == 0) {
+        uint32_t idx = (h->pos + done) / blockSize;
+        uint32_t offset = (h->pos + done) % blockSize;
+        int block = blockAt(f, idx);
+        if (block == -1) {
+            ret = -1;
+            break;
+        }
+        if (offset == 0 && len - done >= (uint32_t)blockSize) {
+            uint32_t count = 1;
+            while ((int)count < maxRunBlocks() && len - done >= (count + 1) * blockSize &&
+                   blockAt(f, idx + count) == block + (int)count) {
+                count++;
             }
-
-            dir_entry entries[ROOT_DIR_SIZE];
-            this->disk.read(dirBlock, reinterpret_cast<uint8_t*>(entries));
-
-            if (token == "..") {
-                // Move to parent directory
-                bool foundParent = false;
-                for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-                    if (strcmp(entries[i].file_name, "..") == 0 && entries[i].type == TYPE_DIR) {
-                        dirBlock = entries[i].first_blk;
-                        foundParent = true;
-                        break;
-                    }
-                }
-                // To the sub directory
-                if (!foundParent) {
-                    cerr << "[ERROR] Could not find parent directory.\n";
-                    return -1;
-                }
+            ret = this->cache.submit_write_run(block, count, const_cast<uint8_t*>(buf) + done);
+            done += count * blockSize;
+        } else {
+            uint32_t n = min(len - done, (uint32_t)blockSize - offset);
+            partial.resize(blockSize);
+            if ((uint64_t)idx * blockSize < f.entry.size) {
+                ret = this->cache.read(block, partial.data());
             } else {
-                // Sub directory
-                bool found = false;
-                for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-                    if (strcmp(entries[i].file_name, token.c_str()) == 0 && entries[i].type == TYPE_DIR) {
-                        dirBlock = entries[i].first_blk;
-                        found = true;
-                        break;
-                    }
-                }
-                if (!found) {
-                    cerr << "[ERROR] Directory '" << token << "' not found.\n";
-                    return -1;
-                }
+                fill(partial.begin(), partial.end(), 0);
+            }
+            memcpy(partial.data() + offset, buf + done, n);
+            if (ret == 0) {
+                ret = this->cache.write(block, partial.data());
             }
+            done += n;
         }
-        current_directory_block = dirBlock;
-        return dirBlock;
+    }
+    if (this->cache.wait_runs() != 0 || ret != 0) {
+        return -1;
+    }
+    h->pos = end;
+    if (end > f.entry.size) {
+        f.entry.size = end;
+        f.dirty = true;
+    }
+    return len;
+}
+
+// sets the position like lseek, whence is SEEK_SET, SEEK_CUR or SEEK_END
+int64_t FS::seek(int fd, int64_t offset, int whence)
+{
+    op_scope op{*this, false};
+    file_handle *h = handleFor(fd);
+    if (h == nullptr) {
+        return -1;
+    }
+    if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) {
+        return -1;
+    }
+    open_file &f = *h->file;
+    lock_guard<mutex> guard(f.lock);
+    int64_t base = (whence == SEEK_CUR) ? h->pos : (whence == SEEK_END) ? f.entry.size : 0;
+    if (base + offset < 0 || base + offset > UINT32_MAX) {
+        return -1;
+    }
+    h->pos = (uint32_t)(base + offset);
+    return h->pos;
+}
+
+// forgets a descriptor, and its open file with the last one. Called with
+// the lock of the open file held.
+void FS::forgetHandle(int fd)
+{
+    lock_guard<mutex> guard(handleLock);
+    auto it = handles.find(fd);
+    if (it == handles.end()) {
+        return;
+    }
+    open_file &f = *it->second.file;
+    if (--f.refs == 0) {
+        openFiles.erase({f.dirBlock, f.slot});
+    }
+    handles.erase(it);
+}
+
+// closes fd and removes its file, for a file that could not be written
+// completely. A file that is open elsewhere as well stays.
+void FS::abandon(int fd)
+{
+    file_handle *h = handleFor(fd);
+    if (h == nullptr) {
+        return;
+    }
+    shared_ptr<open_file> file = h->file;
+    open_file &f = *file;
+    dir_guard dirs(*this, f.dirBlock, true);
+    lock_guard<mutex> guard(f.lock);
+    bool alone;
+    {
+        lock_guard<mutex> refsGuard(handleLock);
+        alone = f.refs == 1;
+    }
+    if (alone) {
+        this->freeChain((int)f.entry.first_blk);
+        this->clearSlots(f.dirBlock, f.slot, 1 + f.dataSlots);
+    }
+    forgetHandle(fd);
+}
+
+// closes a descriptor, a file that is still empty gets its one block. If
+// that fails the descriptor stays open, for the caller to abandon. The
+// entry of a changed file is written back by whichever descriptor of it
+// closes first.
+int FS::close(int fd)
+{
+    op_scope op{*this, false};
+    file_handle *h = handleFor(fd);
+    if (h == nullptr) {
+        return -1;
+    }
+    shared_ptr<open_file> file = h->file;
+    open_file &f = *file;
+    // the entry may move within its directory, but never leaves it
+    dir_guard dirs(*this, f.dirBlock, true);
+    lock_guard<mutex> guard(f.lock);
+    // an inline file that finds no room in its directory gets a block
+    if (f.inlined && f.dirty && storeInline(f) != 0 && spill(f) != 0) {
+        return -1;
+    }
+    if (!f.inlined && (h->flags & OPEN_WRITE) != 0 && f.entry.first_blk < sb.data_start && reserve(f, 1) != 0) {
+        return -1;
+    }
+    int ret = 0;
+    if (!f.inlined && f.dirty) {
+        if (this->writeEntry(f.dirBlock, f.slot, f.entry) != 0) {
+            ret = -1;
+        }
+        this->clearSlots(f.dirBlock, f.slot + 1, f.dataSlots);
+        f.dataSlots = 0;
+    }
+    f.dirty = false;
+    forgetHandle(fd);
+    return ret;
 }
 
 // create <filepath> creates a new file on the disk, the data content is
 // written on the following rows (ended with an empty row)
 int FS::create(string filepath) {
+    op_timer timer{*this, OP_CREATE};
+    op_scope op{*this};
 
     // Separate directory path and filename
     string directoryPath;
@@ -134,16 +1634,13 @@ int FS::create(string filepath) {
         cerr << "[ERROR] Failed to resolve directory path.\n";
         return -1;
     }
+    // the write permission is kept in the parent's entry for the directory
+    int parentBlock = (targetDirBlock == ROOT_BLOCK) ? -1 : this->parentOf(targetDirBlock);
+    dir_guard dirs(*this, targetDirBlock, true, parentBlock, false);
 
-
-    dir_entry currentDir[ROOT_DIR_SIZE];
-    this->disk.read(targetDirBlock, reinterpret_cast<uint8_t*>(currentDir));
-
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(currentDir[i].file_name, filename.c_str()) == 0 && currentDir[i].file_name[0] != '\0') {
-            cerr << "[ERROR] File '" << filename << "' already exists.\n";
-            return -1;
-        }
+    if (this->findEntry(targetDirBlock, filename) != -1) {
+        cerr << "[ERROR] File '" << filename << "' already exists.\n";
+        return -1;
     }
 
     // Check if the directory has write permissions
@@ -152,30 +1649,17 @@ int FS::create(string filepath) {
     if (targetDirBlock == ROOT_BLOCK) {
         writePermission = true;
     } else {
-        int parentBlock = -1;
-        for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-            if (strcmp(currentDir[i].file_name, "..") == 0 && currentDir[i].type == TYPE_DIR) {
-                parentBlock = currentDir[i].first_blk;
-                break;
-            }
-        }
-
         if (parentBlock == -1) {
             cerr << "[ERROR] Could not find the parent directory.\n";
             return -1;
         }
 
-        // Read the parent directory
-        dir_entry parentDir[ROOT_DIR_SIZE];
-        this->disk.read(parentBlock, reinterpret_cast<uint8_t*>(parentDir));
-
-        for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-            if (parentDir[i].type == TYPE_DIR && parentDir[i].first_blk == (uint16_t)targetDirBlock) {
-                if ((parentDir[i].access_rights & WRITE) != 0) {
-                    writePermission = true;
-                }
-                break;
-            }
+        // the directory's entry in its parent
+        int childSlot = this->findSubdir(parentBlock, targetDirBlock);
+        dir_entry child;
+        if (childSlot != -1 && this->readEntry(parentBlock, childSlot, child) == 0 &&
+            (child.access_rights & WRITE) != 0) {
+            writePermission = true;
         }
     }
 
@@ -185,172 +1669,92 @@ int FS::create(string filepath) {
     }
 
 
-    vector<char> fileData;
-    {
-        bool lastWasNewline = false;
-        while (true) {
+    // The content is streamed to the file STREAM_BYTES at a time. After an
+    // error the input is still read to its end, so it is not taken for
+    // commands.
+    bool tooLong = filename.length() > sizeof(dir_entry::file_name) - 1;
+    int fd = tooLong ? -1 : this->openEntry(targetDirBlock, filename, OPEN_WRITE | OPEN_CREATE);
+    dirs.release();
+    bool full = false;
+    vector<char> chunk;
+    chunk.reserve(STREAM_BYTES);
+    bool lastWasNewline = false;
+    bool ended = false;
+    while (!ended) {
+        auto waitStart = chrono::steady_clock::now();
+        chunk.clear();
+        while (chunk.size() < STREAM_BYTES) {
             int c = cin.get();
             if (c == EOF) {
+                ended = true;
                 break;
             }
             char ch = (char)c;
             if (ch == '\n') {
                 if (lastWasNewline) {
+                    ended = true;
                     break;
                 }
                 lastWasNewline = true;
             } else {
                 lastWasNewline = false;
             }
-            fileData.push_back(ch);
+            chunk.push_back(ch);
         }
-    }
-
+        // the time spent waiting for the input is not part of the latency
+        timer.exclude(chrono::steady_clock::now() - waitStart);
 
-    dir_entry fileInfo;
-    memset(&fileInfo, 0, sizeof(dir_entry));
+        if (fd != -1 && !full && !chunk.empty() &&
+            this->write(fd, reinterpret_cast<uint8_t*>(chunk.data()), (uint32_t)chunk.size()) != (int64_t)chunk.size()) {
+            full = true;
+        }
+    }
 
-    if (filename.length() > sizeof(fileInfo.file_name) - 1) {
+    if (tooLong) {
         cerr << "[ERROR] Filename too long.\n";
         return -1;
     }
-
-    strncpy(fileInfo.file_name, filename.c_str(), sizeof(fileInfo.file_name) - 1);
-    fileInfo.size = (uint32_t)fileData.size();
-    fileInfo.type = TYPE_FILE;
-    fileInfo.access_rights = READ | WRITE;
-
-    // Calculate how many blocks are needed
-    const int fat_entries = BLOCK_SIZE / 2;
-    int blocksNeeded = (fileInfo.size == 0) ? 1 : (int)((fileInfo.size + BLOCK_SIZE - 1) / BLOCK_SIZE);
-
-    // Find free blocks in FAT
-    int startBlockIndex = -1;
-    for (int i = 2; i < fat_entries; i++) {
-        if (this->fat[i] == FAT_FREE) {
-            startBlockIndex = i;
-            break;
-        }
-    }
-    if (startBlockIndex == -1) {
-        cerr << "[ERROR] No free blocks available.\n";
+    if (fd == -1) {
+        cerr << "[ERROR] No space in target directory.\n";
         return -1;
     }
-
-    fileInfo.first_blk = (uint16_t)startBlockIndex;
-
-    int currentFatBlock = startBlockIndex;
-    for (int j = 0; j < blocksNeeded; j++) {
-        if (j == blocksNeeded - 1) {
-            this->fat[currentFatBlock] = FAT_EOF;
-        } else {
-            int nextFreeBlock = -1;
-            for (int k = currentFatBlock + 1; k < fat_entries; k++) {
-                if (this->fat[k] == FAT_FREE) {
-                    nextFreeBlock = k;
-                    break;
-                }
-            }
-            if (nextFreeBlock == -1) {
-                cerr << "[ERROR] Not enough blocks for this large file.\n";
-                int rb = startBlockIndex;
-                while (rb != FAT_EOF && rb != FAT_FREE) {
-                    int nxt = this->fat[rb];
-                    this->fat[rb] = FAT_FREE;
-                    if (nxt == FAT_EOF || nxt == FAT_FREE) break;
-                    rb = nxt;
-                }
-                return -1;
-            }
-            this->fat[currentFatBlock] = nextFreeBlock;
-            currentFatBlock = nextFreeBlock;
-        }
-    }
-
-    this->disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(this->fat));
-
-    {
-        uint8_t dirBuffer[BLOCK_SIZE] = {0};
-        bool inserted = false;
-        for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-            if (currentDir[i].file_name[0] == '\0' && currentDir[i].first_blk == 0) {
-                currentDir[i] = fileInfo;
-                memcpy(dirBuffer, currentDir, sizeof(currentDir));
-                this->disk.write(targetDirBlock, dirBuffer);
-                inserted = true;
-                break;
-            }
-        }
-        if (!inserted) {
-            cerr << "[ERROR] No space in target directory.\n";
-            int rb = fileInfo.first_blk;
-            while (rb != FAT_EOF && rb != FAT_FREE) {
-                int nxt = this->fat[rb];
-                this->fat[rb] = FAT_FREE;
-                if (nxt == FAT_EOF || nxt == FAT_FREE) break;
-                rb = nxt;
-            }
-            this->disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(this->fat));
-            return -1;
-        }
-    }
-
-    // Write file data to allocated blocks
-    int remaining = (int)fileInfo.size;
-    int offset = 0;
-    int writeBlock = fileInfo.first_blk;
-    uint8_t blockBuffer[BLOCK_SIZE];
-
-    while (writeBlock != FAT_EOF && remaining > 0) {
-        int dataSize = (remaining > BLOCK_SIZE) ? BLOCK_SIZE : remaining;
-        memset(blockBuffer, 0, BLOCK_SIZE);
-        memcpy(blockBuffer, &fileData[offset], dataSize);
-
-        this->disk.write(writeBlock, blockBuffer);
-
-        offset += dataSize;
-        remaining -= dataSize;
-        writeBlock = this->fat[writeBlock];
+    if (full || this->close(fd) != 0) {
+        cerr << "[ERROR] Not enough free blocks for this file.\n";
+        this->abandon(fd);
+        return -1;
     }
 
-    // update arrays
-    disk.read(ROOT_BLOCK, reinterpret_cast<uint8_t*>(root_dir));
-    disk.read(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat));
-
-
     return 0;
 }
 
-int FS::cat(string filepath) {
+int FS::cat(string filepath, uint64_t offset, uint64_t len) {
+    op_timer timer{*this, OP_CAT};
+    op_scope op{*this, false};
+    // the directory the last resolved path led to
+    int dirBlock = self().resolved;
+    dir_guard dirs(*this, ROOT_BLOCK, false, dirBlock, false);
 
     // Locate the file in the root directory
-    dir_entry temp[ROOT_DIR_SIZE];
-    disk.read(current_directory_block, reinterpret_cast<uint8_t*>(temp));
     dir_entry fileInfo;
 
+    // an entry in the root directory wins over one in a later slot of the
+    // current directory
+    int rootIndex = this->findEntry(ROOT_BLOCK, filepath);
+    int tempIndex = this->findEntry(dirBlock, filepath);
     int fileIndex = -1;
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(root_dir[i].file_name, filepath.c_str()) == 0) {
-            fileIndex = i;
-            fileInfo = root_dir[fileIndex];
-            if ((root_dir[fileIndex].access_rights & READ) == 0) {
-                cout << "File not readable" << endl;
-                return -1;
-            }
-            break;
-        }
-        else
-        {
-            if (strcmp(temp[i].file_name, filepath.c_str()) == 0) {
-            fileIndex = i;
-            fileInfo = temp[fileIndex];
-            if ((temp[fileIndex].access_rights & READ) == 0) {
-                cout << "File not readable" << endl;
-                return -1;
-                }
-            break;
-            }
-        }
+    int fileDirBlock = -1;
+    if (rootIndex != -1 && (tempIndex == -1 || rootIndex <= tempIndex)) {
+        fileIndex = rootIndex;
+        fileInfo = root_dir[fileIndex];
+        fileDirBlock = ROOT_BLOCK;
+    } else if (tempIndex != -1) {
+        fileIndex = tempIndex;
+        this->readEntry(dirBlock, fileIndex, fileInfo);
+        fileDirBlock = dirBlock;
+    }
+    if (fileIndex != -1 && (fileInfo.access_rights & READ) == 0) {
+        cout << "File not readable" << endl;
+        return -1;
     }
 
     if (fileIndex == -1) {
@@ -363,23 +1767,32 @@ int FS::cat(string filepath) {
         return -1;
     }
 
-    // Read the file data block by block using FAT
-    uint8_t buffer[BLOCK_SIZE];
-    int currentBlock = fileInfo.first_blk;
-    int remainingSize = fileInfo.size;
-
-    while (currentBlock != FAT_EOF && remainingSize > 0) {
-        // Read the current block from disk
-        disk.read(currentBlock, buffer);
-
-        int dataSize = (remainingSize > BLOCK_SIZE) ? BLOCK_SIZE : remainingSize;
-
-        for (int i = 0; i < dataSize; i++) {
-            cout << static_cast<char>(buffer[i]);
-        }
+    if (offset > fileInfo.size) {
+        cerr << "Error: Offset is past the end of the file.\n";
+        return -1;
+    }
+    uint32_t remaining = (uint32_t)min(len, fileInfo.size - offset);
 
-        remainingSize -= dataSize;
-        currentBlock = fat[currentBlock];
+    // Stream the file through a bounded buffer, each read queues the runs
+    // of consecutive blocks it covers. The seek starts from the chain
+    // sample closest to offset.
+    int fd = this->openEntry(fileDirBlock, filepath, OPEN_READ);
+    if (fd == -1) {
+        cerr << "Error: Could not read file.\n";
+        return -1;
+    }
+    dirs.release();
+    this->seek(fd, (int64_t)offset, SEEK_SET);
+    vector<uint8_t> buffer(min((uint32_t)STREAM_BYTES, remaining));
+    int64_t n = 0;
+    while (remaining > 0 && (n = this->read(fd, buffer.data(), min((uint32_t)buffer.size(), remaining))) > 0) {
+        cout.write(reinterpret_cast<const char*>(buffer.data()), n);
+        remaining -= (uint32_t)n;
+    }
+    this->close(fd);
+    if (n < 0) {
+        cerr << "Error: Could not read file.\n";
+        return -1;
     }
 
     cout << endl;
@@ -388,40 +1801,29 @@ int FS::cat(string filepath) {
 }
 
 int FS::ls() {
-
-    dir_entry entries[ROOT_DIR_SIZE];
-    this->disk.read(this->currentBlock, reinterpret_cast<uint8_t*>(entries));
+    op_scope op{*this, false};
+    int block = self().block;
+    // '..' is the first entry, so this normally reads one block
+    int parentBlock = (block == ROOT_BLOCK) ? -1 : this->parentOf(block);
+    dir_guard dirs(*this, block, false, parentBlock, false);
 
     bool readPermission = false;
 
-    if (this->currentBlock == ROOT_BLOCK) {
+    if (block == ROOT_BLOCK) {
         // Root directory is always readable
         readPermission = true;
     } else {
-        int parentBlock = -1;
-        for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-            if (strcmp(entries[i].file_name, "..") == 0 && entries[i].type == TYPE_DIR) {
-                parentBlock = entries[i].first_blk;
-                break;
-            }
-        }
-
         if (parentBlock == -1) {
             cerr << "[ERROR] Could not find the parent directory.\n";
             return -1;
         }
 
-        // Read the parent directory
-        dir_entry parentDir[ROOT_DIR_SIZE];
-        this->disk.read(parentBlock, reinterpret_cast<uint8_t*>(parentDir));
-
-        for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-            if (parentDir[i].type == TYPE_DIR && parentDir[i].first_blk == (uint16_t)this->currentBlock) {
-                if ((parentDir[i].access_rights & READ) != 0) {
-                    readPermission = true;
-                }
-                break;
-            }
+        // the directory's entry in its parent
+        int childSlot = this->findSubdir(parentBlock, block);
+        dir_entry child;
+        if (childSlot != -1 && this->readEntry(parentBlock, childSlot, child) == 0 &&
+            (child.access_rights & READ) != 0) {
+            readPermission = true;
         }
     }
 
@@ -434,26 +1836,31 @@ int FS::ls() {
     cout << "name\t\ttype\t\tsize\t\taccess\n";
 
 
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (entries[i].file_name[0] != '\0') {
-            string typeStr = (entries[i].type == TYPE_DIR) ? "dir" : "file";
-            string sizeStr = (entries[i].type == TYPE_DIR) ? "-" : to_string(entries[i].size);
-
-            // Access rights string
-            char r = (entries[i].access_rights & READ) ? 'r' : '-';
-            char w = (entries[i].access_rights & WRITE) ? 'w' : '-';
-            char x = (entries[i].access_rights & EXECUTE) ? 'x' : '-';
-            string accessStr;
-            accessStr.push_back(r);
-            accessStr.push_back(w);
-            accessStr.push_back(x);
-
-            cout << entries[i].file_name << "\t\t" 
-                      << typeStr << "\t\t" 
-                      << sizeStr << "\t\t" 
-                      << accessStr << "\n";
+    // entries are printed block by block, large directories are never held
+    // in memory as a whole
+    this->streamDir(block, [&](const dir_entry *entries, int count) {
+        for (int i = 0; i < count; i++) {
+            if (entries[i].file_name[0] != '\0' && entries[i].file_name[0] != INLINE_MARK) {
+                string typeStr = (entries[i].type == TYPE_DIR) ? "dir" : "file";
+                string sizeStr = (entries[i].type == TYPE_DIR) ? "-" : to_string(entries[i].size);
+
+                // Access rights string
+                char r = (entries[i].access_rights & READ) ? 'r' : '-';
+                char w = (entries[i].access_rights & WRITE) ? 'w' : '-';
+                char x = (entries[i].access_rights & EXECUTE) ? 'x' : '-';
+                string accessStr;
+                accessStr.push_back(r);
+                accessStr.push_back(w);
+                accessStr.push_back(x);
+
+                cout << entries[i].file_name << "\t\t" 
+                          << typeStr << "\t\t" 
+                          << sizeStr << "\t\t" 
+                          << accessStr << "\n";
+            }
         }
-    }
+        return true;
+    });
 
     return 0;
 }
@@ -461,6 +1868,8 @@ int FS::ls() {
 // cp <sourcepath> <destpath> makes an exact copy of the file
 // <sourcepath> to a new file <destpath>
 int FS::cp(string sourcepath, string destpath) {
+    op_timer timer{*this, OP_CP};
+    op_scope op{*this};
 
     auto separatePath = [&](const string &fullPath) {
         string directoryPath;
@@ -484,61 +1893,37 @@ int FS::cp(string sourcepath, string destpath) {
         cerr << "[ERROR] cp failed: source directory path could not be resolved.\n";
         return -1;
     }
-
-    dir_entry sourceDir[ROOT_DIR_SIZE];
-    this->disk.read(sourceDirBlock, reinterpret_cast<uint8_t*>(sourceDir));
-
-    int sourceIndex = -1;
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(sourceDir[i].file_name, sourceFilename.c_str()) == 0 && sourceDir[i].file_name[0] != '\0') {
-            sourceIndex = i;
-            break;
-        }
-    }
-    if (sourceIndex == -1) {
-        cerr << "[ERROR] Source file '" << sourceFilename << "' does not exist.\n";
+    auto [destDirPath, destFilename] = separatePath(destpath);
+    int destDirBlock = resolvePathToDirectory(destDirPath);
+    if (destDirBlock == -1) {
+        cerr << "[ERROR] cp failed: destination directory path could not be resolved.\n";
         return -1;
     }
+    // a destination that names a directory gets the file, so that one is
+    // locked as well
+    int into = this->subdirNamed(destDirBlock, destFilename.empty() ? sourceFilename : destFilename);
+    dir_guard dirs(*this, sourceDirBlock, false, destDirBlock, into == -1, into, true);
 
-    dir_entry sourceFileInfo = sourceDir[sourceIndex];
-    if (sourceFileInfo.type == TYPE_DIR) {
-        cerr << "[ERROR] Source is a directory, not a file.\n";
+    int sourceIndex = -1;
+    sourceIndex = this->findEntry(sourceDirBlock, sourceFilename);
+    dir_entry sourceFileInfo;
+    if (sourceIndex == -1 || this->readEntry(sourceDirBlock, sourceIndex, sourceFileInfo) != 0) {
+        cerr << "[ERROR] Source file '" << sourceFilename << "' does not exist.\n";
         return -1;
     }
 
-    vector<uint8_t> fileData;
-    fileData.reserve(sourceFileInfo.size);
-    int remaining = (int)sourceFileInfo.size;
-    int readBlock = sourceFileInfo.first_blk;
-    uint8_t blockBuffer[BLOCK_SIZE];
-
-    while (readBlock != FAT_EOF && remaining > 0) {
-        this->disk.read(readBlock, blockBuffer);
-        int dataSize = (remaining > BLOCK_SIZE) ? BLOCK_SIZE : remaining;
-        for (int i = 0; i < dataSize; i++) {
-            fileData.push_back(blockBuffer[i]);
-        }
-        remaining -= dataSize;
-        readBlock = this->fat[readBlock];
-    }
-
-
-    auto [destDirPath, destFilename] = separatePath(destpath);
-    int destDirBlock = resolvePathToDirectory(destDirPath);
-    if (destDirBlock == -1) {
-        cerr << "[ERROR] cp failed: destination directory path could not be resolved.\n";
+    if (sourceFileInfo.type == TYPE_DIR) {
+        cerr << "[ERROR] Source is a directory, not a file.\n";
         return -1;
     }
 
-    dir_entry destDirEntries[ROOT_DIR_SIZE];
-    this->disk.read(destDirBlock, reinterpret_cast<uint8_t*>(destDirEntries));
 
     int destIndex = -1;
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(destDirEntries[i].file_name, destFilename.c_str()) == 0 && destDirEntries[i].file_name[0] != '\0') {
-            destIndex = i;
-            break;
-        }
+    destIndex = this->findEntry(destDirBlock, destFilename);
+    // the entry the destination names, if there is one
+    dir_entry destInfo;
+    if (destIndex != -1 && this->readEntry(destDirBlock, destIndex, destInfo) != 0) {
+        destIndex = -1;
     }
 
     if (destFilename.empty()) {
@@ -547,133 +1932,128 @@ int FS::cp(string sourcepath, string destpath) {
 
 
     // Check access rights 
-    if ((sourceDir[sourceIndex].access_rights & READ) == 0 || (destDirEntries[destIndex].access_rights & WRITE) == 0) {
+    if ((sourceFileInfo.access_rights & READ) == 0 || (destIndex != -1 && (destInfo.access_rights & WRITE) == 0)) {
         cerr << "[ERROR] Access right issue" << endl;
         return -1;
     }
 
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(destDirEntries[i].file_name, destFilename.c_str()) == 0 && destDirEntries[i].file_name[0] != '\0') {
-            if (destDirEntries[i].type == TYPE_DIR) {
-                int newDirBlock = destDirEntries[i].first_blk;
-                this->disk.read(newDirBlock, reinterpret_cast<uint8_t*>(destDirEntries));
-                destDirBlock = newDirBlock;
-                destFilename = sourceFilename;
-            } else {
-                cerr << "[ERROR] Destination file '" << destFilename << "' already exists (no overwrite allowed).\n";
+    int existing = this->findEntry(destDirBlock, destFilename);
+    dir_entry existingInfo;
+    if (existing != -1 && this->readEntry(destDirBlock, existing, existingInfo) == 0) {
+        if (existingInfo.type == TYPE_DIR) {
+            int newDirBlock = existingInfo.first_blk;
+            if (newDirBlock != into) {
+                cerr << "[ERROR] Destination directory '" << destFilename << "' changed, try again.\n";
                 return -1;
             }
-            break;
+            destDirBlock = newDirBlock;
+            destFilename = sourceFilename;
+        } else {
+            cerr << "[ERROR] Destination file '" << destFilename << "' already exists (no overwrite allowed).\n";
+            return -1;
         }
     }
 
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(destDirEntries[i].file_name, destFilename.c_str()) == 0 && destDirEntries[i].file_name[0] != '\0') {
-            cerr << "[ERROR] Destination file '" << destFilename << "' already exists.\n";
-            return -1;
-        }
+    if (this->findEntry(destDirBlock, destFilename) != -1) {
+        cerr << "[ERROR] Destination file '" << destFilename << "' already exists.\n";
+        return -1;
     }
 
-    dir_entry newFile;
-    memset(&newFile, 0, sizeof(dir_entry));
-    if (destFilename.length() > sizeof(newFile.file_name) - 1) {
+    if (destFilename.length() > sizeof(dir_entry::file_name) - 1) {
         cerr << "[ERROR] Destination filename too long.\n";
         return -1;
     }
-    strncpy(newFile.file_name, destFilename.c_str(), sizeof(newFile.file_name) - 1);
-    newFile.size = (uint32_t)fileData.size();
-    newFile.type = TYPE_FILE;
-    newFile.access_rights = READ | WRITE;
-
-    // Allocate FAT blocks for new file
-    const int fat_entries = BLOCK_SIZE / 2;
-    int blocksNeeded = (newFile.size == 0) ? 1 : (int)((newFile.size + BLOCK_SIZE - 1) / BLOCK_SIZE);
 
-    int startBlockIndex = -1;
-    for (int i = 2; i < fat_entries; i++) {
-        if (this->fat[i] == FAT_FREE) {
-            startBlockIndex = i;
-            break;
-        }
+    int in = this->openEntry(sourceDirBlock, sourceFilename, OPEN_READ);
+    if (in == -1) {
+        cerr << "[ERROR] Could not read source file '" << sourceFilename << "'.\n";
+        return -1;
     }
-    if (startBlockIndex == -1) {
-        cerr << "[ERROR] No free blocks available for copying.\n";
+    int out = this->openEntry(destDirBlock, destFilename, OPEN_WRITE | OPEN_CREATE);
+    if (out == -1) {
+        cerr << "[ERROR] No space in destination directory.\n";
+        dirs.release();
+        this->close(in);
         return -1;
     }
 
-    newFile.first_blk = (uint16_t)startBlockIndex;
-
-    int currentFatBlock = startBlockIndex;
-    for (int j = 0; j < blocksNeeded; j++) {
-        if (j == blocksNeeded - 1) {
-            this->fat[currentFatBlock] = FAT_EOF;
-        } else {
-            int nextFreeBlock = -1;
-            for (int k = currentFatBlock + 1; k < fat_entries; k++) {
-                if (this->fat[k] == FAT_FREE) {
-                    nextFreeBlock = k;
-                    break;
-                }
+    // The copy shares the blocks of the source, each one gains a reference
+    // and the data is only copied when one of the files is written
+    if (this->reflinks() && sourceFileInfo.first_blk >= sb.data_start && sourceFileInfo.first_blk < sb.no_blocks) {
+        // the source as its descriptors see it, which may be newer than
+        // its entry on disk
+        shared_ptr<open_file> source = handleFor(in)->file;
+        {
+            lock_guard<mutex> guard(source->lock);
+            sourceFileInfo = source->entry;
+            source->owned = 0;
+            lock_guard<mutex> alloc(allocLock);
+            for (int b = (int)sourceFileInfo.first_blk; b >= (int)sb.data_start && b < (int)sb.no_blocks;
+                 b = this->fat.get(b)) {
+                this->refs.set(b, this->refs.get(b) + 1);
             }
-            if (nextFreeBlock == -1) {
-                cerr << "[ERROR] Not enough blocks available to copy the large file.\n";
-                // Rollback
-                int rb = startBlockIndex;
-                while (rb != FAT_EOF && rb != FAT_FREE) {
-                    int nxt = this->fat[rb];
-                    this->fat[rb] = FAT_FREE;
-                    if (nxt == FAT_EOF || nxt == FAT_FREE) break;
-                    rb = nxt;
+        }
+        // other open files on the same chain, one lock at a time
+        vector<shared_ptr<open_file>> sharing;
+        {
+            lock_guard<mutex> guard(handleLock);
+            for (auto &[key, f] : openFiles) {
+                if (f != source) {
+                    sharing.push_back(f);
                 }
-                return -1;
             }
-            this->fat[currentFatBlock] = nextFreeBlock;
-            currentFatBlock = nextFreeBlock;
         }
+        for (shared_ptr<open_file> &f : sharing) {
+            lock_guard<mutex> guard(f->lock);
+            if (f->entry.first_blk == sourceFileInfo.first_blk) {
+                f->owned = 0;
+            }
+        }
+        {
+            lock_guard<mutex> guard(chainLock);
+            auto known = chains.find(sourceFileInfo.first_blk);
+            if (known != chains.end()) {
+                known->second.owned = 0;
+            }
+        }
+        {
+            open_file &copy = *handleFor(out)->file;
+            lock_guard<mutex> guard(copy.lock);
+            copy.inlined = false;
+            copy.entry.first_blk = sourceFileInfo.first_blk;
+            copy.entry.size = sourceFileInfo.size;
+            copy.dirty = true;
+        }
+        dirs.release();
+        this->close(in);
+        return this->close(out);
+    }
+
+    // Allocate all blocks at once, as contiguous as the free space allows,
+    // then stream the data across through a bounded buffer
+    dirs.release();
+    if (this->preallocate(out, sourceFileInfo.size) != 0) {
+        cerr << "[ERROR] Not enough free blocks to copy the file.\n";
+        this->close(in);
+        this->abandon(out);
+        return -1;
     }
 
-    this->disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(this->fat));
-
-    uint8_t dirBuffer[BLOCK_SIZE];
-    bool inserted = false;
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (destDirEntries[i].file_name[0] == '\0' && destDirEntries[i].first_blk == 0) {
-            destDirEntries[i] = newFile;
-            memcpy(dirBuffer, destDirEntries, sizeof(destDirEntries));
-            this->disk.write(destDirBlock, dirBuffer);
-            inserted = true;
+    vector<uint8_t> buffer(min((uint32_t)STREAM_BYTES, sourceFileInfo.size));
+    int64_t n;
+    while ((n = this->read(in, buffer.data(), (uint32_t)buffer.size())) > 0) {
+        if (this->write(out, buffer.data(), (uint32_t)n) != n) {
+            n = -1;
             break;
         }
     }
-    if (!inserted) {
-        cerr << "[ERROR] No space in destination directory.\n";
-        int rb = newFile.first_blk;
-        while (rb != FAT_EOF && rb != FAT_FREE) {
-            int nxt = this->fat[rb];
-            this->fat[rb] = FAT_FREE;
-            if (nxt == FAT_EOF || nxt == FAT_FREE) break;
-            rb = nxt;
-        }
-        this->disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(this->fat));
+    this->close(in);
+    if (n < 0 || this->close(out) != 0) {
+        cerr << "[ERROR] Could not copy source file '" << sourceFilename << "'.\n";
+        this->abandon(out);
         return -1;
     }
 
-    int toWrite = (int)newFile.size;
-    int offset = 0;
-    int writeBlock = newFile.first_blk;
-
-    while (writeBlock != FAT_EOF && toWrite > 0) {
-        int dataSize = (toWrite > BLOCK_SIZE) ? BLOCK_SIZE : toWrite;
-        memset(blockBuffer, 0, BLOCK_SIZE);
-        memcpy(blockBuffer, &fileData[offset], dataSize);
-
-        this->disk.write(writeBlock, blockBuffer);
-
-        offset += dataSize;
-        toWrite -= dataSize;
-        writeBlock = this->fat[writeBlock];
-    }
-
     return 0;
 }
 
@@ -681,6 +2061,8 @@ int FS::cp(string sourcepath, string destpath) {
 // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
 int FS::mv(string sourcepath, string destpath)
 {
+    op_timer timer{*this, OP_MV};
+    op_scope op{*this};
  
     auto separatePath = [&](const string &fullPath) {
         string directoryPath;
@@ -704,45 +2086,40 @@ int FS::mv(string sourcepath, string destpath)
         cerr << "[ERROR] mv failed: source directory path could not be resolved.\n";
         return -1;
     }
-
-    dir_entry sourceDir[ROOT_DIR_SIZE];
-    this->disk.read(sourceDirBlock, reinterpret_cast<uint8_t*>(sourceDir));
+    auto [destDirPath, destFilename] = separatePath(destpath);
+    int destDirBlock = resolvePathToDirectory(destDirPath);
+    if (destDirBlock == -1) {
+        cerr << "[ERROR] mv failed: destination directory path could not be resolved.\n";
+        return -1;
+    }
+    // a destination that names a directory gets the file, so that one is
+    // locked as well
+    int into = this->subdirNamed(destDirBlock, destFilename.empty() ? sourceFilename : destFilename);
+    dir_guard dirs(*this, sourceDirBlock, true, destDirBlock, into == -1, into, true);
 
     int sourceIndex = -1;
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(sourceDir[i].file_name, sourceFilename.c_str()) == 0 && sourceDir[i].file_name[0] != '\0') {
-            sourceIndex = i;
-            break;
-        }
-    }
-    if (sourceIndex == -1) {
+    sourceIndex = this->findEntry(sourceDirBlock, sourceFilename);
+    dir_entry sourceFileInfo;
+    if (sourceIndex == -1 || this->readEntry(sourceDirBlock, sourceIndex, sourceFileInfo) != 0) {
         cerr << "[ERROR] Source file '" << sourceFilename << "' does not exist.\n";
         return -1;
     }
 
-    dir_entry sourceFileInfo = sourceDir[sourceIndex];
     if (sourceFileInfo.type == TYPE_DIR) {
         cerr << "[ERROR] Source is a directory, not a file.\n";
         return -1;
     }
-
-    auto [destDirPath, destFilename] = separatePath(destpath);
-    int destDirBlock = resolvePathToDirectory(destDirPath);
-    if (destDirBlock == -1) {
-        cerr << "[ERROR] mv failed: destination directory path could not be resolved.\n";
+    if (this->isOpen(sourceDirBlock, sourceIndex)) {
+        cerr << "[ERROR] File '" << sourceFilename << "' is open.\n";
         return -1;
     }
 
-    // Load the destination directory
-    dir_entry destDirEntries[ROOT_DIR_SIZE];
-    this->disk.read(destDirBlock, reinterpret_cast<uint8_t*>(destDirEntries));
-
     int destIndex = -1;
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(destDirEntries[i].file_name, destFilename.c_str()) == 0 && destDirEntries[i].file_name[0] != '\0') {
-            destIndex = i;
-            break;
-        }
+    destIndex = this->findEntry(destDirBlock, destFilename);
+    // the entry the destination names, if there is one
+    dir_entry destInfo;
+    if (destIndex != -1 && this->readEntry(destDirBlock, destIndex, destInfo) != 0) {
+        destIndex = -1;
     }
 
     if (destFilename.empty()) {
@@ -750,47 +2127,41 @@ int FS::mv(string sourcepath, string destpath)
     }
 
     // Check access rights 
-    if ((sourceDir[sourceIndex].access_rights & READ) == 0 || (destDirEntries[destIndex].access_rights & WRITE) == 0) {
+    if ((sourceFileInfo.access_rights & READ) == 0 || (destIndex != -1 && (destInfo.access_rights & WRITE) == 0)) {
         cerr << "[ERROR] Access right issue" << endl;
         return -1;
     }
 
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(destDirEntries[i].file_name, destFilename.c_str()) == 0 && destDirEntries[i].type == TYPE_DIR && destDirEntries[i].file_name[0] != '\0') {
-            // Destination is a directory, move into it
-            destDirBlock = destDirEntries[i].first_blk;
-            this->disk.read(destDirBlock, reinterpret_cast<uint8_t*>(destDirEntries));
-            destFilename = sourceFilename; 
-            break;
+    int existing = this->findEntry(destDirBlock, destFilename);
+    dir_entry existingInfo;
+    if (existing != -1 && this->readEntry(destDirBlock, existing, existingInfo) == 0 && existingInfo.type == TYPE_DIR) {
+        // Destination is a directory, move into it
+        destDirBlock = existingInfo.first_blk;
+        if (destDirBlock != into) {
+            cerr << "[ERROR] Destination directory '" << destFilename << "' changed, try again.\n";
+            return -1;
         }
+        destFilename = sourceFilename; 
     }
 
     // Check if the destination filename already exists
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(destDirEntries[i].file_name, destFilename.c_str()) == 0 && destDirEntries[i].file_name[0] != '\0') {
-            if (destDirEntries[i].type != TYPE_DIR) {
-                cerr << "[ERROR] Destination file '" << destFilename << "' already exists. No overwrite allowed.\n";
-                return -1;
-            }
-        }
+    existing = this->findEntry(destDirBlock, destFilename);
+    if (existing != -1 && this->readEntry(destDirBlock, existing, existingInfo) == 0 && existingInfo.type != TYPE_DIR) {
+        cerr << "[ERROR] Destination file '" << destFilename << "' already exists. No overwrite allowed.\n";
+        return -1;
     }
 
-    uint8_t dirBuffer[BLOCK_SIZE];
-
     if (sourceDirBlock == destDirBlock) {
-        strncpy(sourceDir[sourceIndex].file_name, destFilename.c_str(), sizeof(sourceDir[sourceIndex].file_name) - 1);
-        memcpy(dirBuffer, sourceDir, sizeof(sourceDir));
-        this->disk.write(sourceDirBlock, dirBuffer);
+        strncpy(sourceFileInfo.file_name, destFilename.c_str(), sizeof(sourceFileInfo.file_name) - 1);
+        this->writeEntry(sourceDirBlock, sourceIndex, sourceFileInfo);
     } else {
 
-        // Find a free slot in the destination directory
-        int freeIndex = -1;
-        for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-            if (destDirEntries[i].file_name[0] == '\0' && destDirEntries[i].first_blk == 0) {
-                freeIndex = i;
-                break;
-            }
-        }
+        // Find a free slot in the destination directory, an inline file
+        // takes its data along
+        bool isInline = (sourceFileInfo.first_blk == INLINE_BLK);
+        int dataSlots = isInline ? inlineSlots(sourceFileInfo.size) : 0;
+        int freeIndex = isInline ? this->findFreeRun(destDirBlock, 1 + dataSlots)
+                                 : this->findFreeSlot(destDirBlock);
         if (freeIndex == -1) {
             cerr << "[ERROR] No space in destination directory.\n";
             return -1;
@@ -799,15 +2170,18 @@ int FS::mv(string sourcepath, string destpath)
         dir_entry newEntry = sourceFileInfo;
         memset(newEntry.file_name, 0, sizeof(newEntry.file_name));
         strncpy(newEntry.file_name, destFilename.c_str(), sizeof(newEntry.file_name)-1);
-        destDirEntries[freeIndex] = newEntry;
 
-        memcpy(dirBuffer, destDirEntries, sizeof(destDirEntries));
-        this->disk.write(destDirBlock, dirBuffer);
+        if (isInline) {
+            this->writeInline(destDirBlock, freeIndex, newEntry,
+                              this->readInline(sourceDirBlock, sourceIndex, sourceFileInfo.size));
+        } else {
+            this->writeEntry(destDirBlock, freeIndex, newEntry);
+        }
 
-        sourceDir[sourceIndex].file_name[0] = '\0';
-        sourceDir[sourceIndex].first_blk = 0;
-        memcpy(dirBuffer, sourceDir, sizeof(sourceDir));
-        this->disk.write(sourceDirBlock, dirBuffer);
+        sourceFileInfo.file_name[0] = '\0';
+        sourceFileInfo.first_blk = 0;
+        this->writeEntry(sourceDirBlock, sourceIndex, sourceFileInfo);
+        this->clearSlots(sourceDirBlock, sourceIndex + 1, dataSlots);
     }
 
     return 0;
@@ -817,7 +2191,20 @@ int FS::mv(string sourcepath, string destpath)
 // rm <filepath> removes / deletes the file <filepath>
 int FS::rm(string filepath)
 {
+    op_timer timer{*this, OP_RM};
+    int ret = this->removeEntry(filepath, false);
+    if (ret == RM_DIRECTORY) {
+        // nothing else may be inside the directory while it goes
+        ret = this->removeEntry(filepath, true);
+    }
+    return ret;
+}
 
+// rm, a directory is only removed with volumeLock held alone. Returns
+// RM_DIRECTORY for one if alone is not set.
+int FS::removeEntry(const string &filepath, bool alone)
+{
+    op_scope op{*this, false, alone};
 
     auto separatePath = [&](const string &fullPath) {
         string directoryPath;
@@ -842,73 +2229,69 @@ int FS::rm(string filepath)
         cerr << "[ERROR] rm failed: directory path could not be resolved.\n";
         return -1;
     }
-
-    dir_entry dirEntries[ROOT_DIR_SIZE];
-    this->disk.read(dirBlock, reinterpret_cast<uint8_t*>(dirEntries));
+    dir_guard dirs(*this, dirBlock, true);
 
     int fileIndex = -1;
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(dirEntries[i].file_name, filename.c_str()) == 0 && dirEntries[i].file_name[0] != '\0') {
-            fileIndex = i;
-            break;
-        }
-    }
+    fileIndex = this->findEntry(dirBlock, filename);
 
-    if (fileIndex == -1) {
+    dir_entry targetEntry;
+    if (fileIndex == -1 || this->readEntry(dirBlock, fileIndex, targetEntry) != 0) {
         cerr << "[ERROR] '" << filename << "' not found in the specified directory.\n";
         return -1;
     }
 
-    dir_entry &targetEntry = dirEntries[fileIndex];
-
     if (targetEntry.type == TYPE_FILE) {
 
-        int currentBlock = targetEntry.first_blk;
-        while (currentBlock != FAT_EOF && currentBlock != FAT_FREE) {
-            int next = this->fat[currentBlock];
-            this->fat[currentBlock] = FAT_FREE;
-            currentBlock = next;
+        if (this->isOpen(dirBlock, fileIndex)) {
+            cerr << "[ERROR] File '" << filename << "' is open.\n";
+            return -1;
         }
-
-        this->disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(this->fat));
+        op.changed();
+        this->freeChain(targetEntry.first_blk);
+        int dataSlots = (targetEntry.first_blk == INLINE_BLK) ? inlineSlots(targetEntry.size) : 0;
 
         memset(&targetEntry, 0, sizeof(dir_entry));
-
-        uint8_t buffer[BLOCK_SIZE];
-        memcpy(buffer, dirEntries, sizeof(dirEntries));
-        this->disk.write(dirBlock, buffer);
+        this->writeEntry(dirBlock, fileIndex, targetEntry);
+        this->clearSlots(dirBlock, fileIndex + 1, dataSlots);
 
 
     } else if (targetEntry.type == TYPE_DIR) {
 
-        dir_entry targetDirEntries[ROOT_DIR_SIZE];
-        this->disk.read(targetEntry.first_blk, reinterpret_cast<uint8_t*>(targetDirEntries));
-
+        if (!alone) {
+            return RM_DIRECTORY;
+        }
         bool empty = true;
-        for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-            if (targetDirEntries[i].file_name[0] != '\0') {
-                if (strcmp(targetDirEntries[i].file_name, "..") != 0) {
+        this->streamDir(targetEntry.first_blk, [&](const dir_entry *entries, int count) {
+            for (int i = 0; i < count; i++) {
+                if (entries[i].file_name[0] != '\0' && strcmp(entries[i].file_name, "..") != 0) {
                     empty = false;
-                    break;
+                    return false;
                 }
             }
-        }
+            return true;
+        });
 
         if (!empty) {
             cerr << "[ERROR] Directory '" << filename << "' is not empty.\n";
             return -1;
         }
+        op.changed();
 
-        int dirBlockToFree = targetEntry.first_blk;
-        this->fat[dirBlockToFree] = FAT_FREE;
-        this->disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(this->fat));
+        // a grown directory gives back every block of its chain
+        vector<int> dirBlocks = this->dirChain(targetEntry.first_blk);
+        {
+            lock_guard<mutex> guard(allocLock);
+            for (int b : dirBlocks) {
+                this->fat.free_later(b);
+                freedBlocks.insert(b);
+                disk.set_dir_block(b, false);
+            }
+        }
+        this->dropIndex(targetEntry.first_blk);
 
         // Remove directory entry from parent directory
         memset(&targetEntry, 0, sizeof(dir_entry));
-
-        uint8_t buffer[BLOCK_SIZE];
-        memcpy(buffer, dirEntries, sizeof(dirEntries));
-        this->disk.write(dirBlock, buffer);
+        this->writeEntry(dirBlock, fileIndex, targetEntry);
 
     } else {
         cerr << "[ERROR] Unknown entry type.\n";
@@ -922,6 +2305,8 @@ int FS::rm(string filepath)
 // the end of file <filepath2>. The file <filepath1> is unchanged.
 int FS::append(string filepath1, string filepath2)
 {
+    op_timer timer{*this, OP_APPEND};
+    op_scope op{*this};
 
     // Helper to separate a path into directory and filename
     auto separatePath = [&](const string &fullPath) {
@@ -946,229 +2331,105 @@ int FS::append(string filepath1, string filepath2)
         cerr << "[ERROR] append failed: source directory path could not be resolved.\n";
         return -1;
     }
-
-    dir_entry srcDir[ROOT_DIR_SIZE];
-    this->disk.read(srcDirBlock, reinterpret_cast<uint8_t*>(srcDir));
+    auto [destDirPath, destFilename] = separatePath(filepath2);
+    int destDirBlock = resolvePathToDirectory(destDirPath);
+    if (destDirBlock == -1) {
+        cerr << "[ERROR] append failed: destination directory path could not be resolved.\n";
+        return -1;
+    }
+    // neither directory changes here, close writes the new size back
+    dir_guard dirs(*this, srcDirBlock, false, destDirBlock, false);
 
     int srcIndex = -1;
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(srcDir[i].file_name, srcFilename.c_str()) == 0 && srcDir[i].file_name[0] != '\0') {
-            srcIndex = i;
-            break;
-        }
-    }
+    srcIndex = this->findEntry(srcDirBlock, srcFilename);
 
-    if (srcIndex == -1) {
+    dir_entry srcFileInfo;
+    if (srcIndex == -1 || this->readEntry(srcDirBlock, srcIndex, srcFileInfo) != 0) {
         cerr << "[ERROR] Source file '" << srcFilename << "' does not exist.\n";
         return -1;
     }
 
-    dir_entry &srcFileInfo = srcDir[srcIndex];
     if (srcFileInfo.type != TYPE_FILE) {
         cerr << "[ERROR] Source path '" << srcFilename << "' is not a file.\n";
         return -1;
     }
 
-    vector<uint8_t> srcData;
-    srcData.reserve(srcFileInfo.size);
-    {
-        int remaining = (int)srcFileInfo.size;
-        int readBlock = srcFileInfo.first_blk;
-        uint8_t blockBuffer[BLOCK_SIZE];
-        while (readBlock != FAT_EOF && remaining > 0) {
-            this->disk.read(readBlock, blockBuffer);
-            int dataSize = (remaining > BLOCK_SIZE) ? BLOCK_SIZE : remaining;
-            for (int i = 0; i < dataSize; i++) {
-                srcData.push_back(blockBuffer[i]);
-            }
-            remaining -= dataSize;
-            readBlock = this->fat[readBlock];
-        }
-    }
-
-
-    auto [destDirPath, destFilename] = separatePath(filepath2);
-    int destDirBlock = resolvePathToDirectory(destDirPath);
-    if (destDirBlock == -1) {
-        cerr << "[ERROR] append failed: destination directory path could not be resolved.\n";
-        return -1;
-    }
-
-    dir_entry destDir[ROOT_DIR_SIZE];
-    this->disk.read(destDirBlock, reinterpret_cast<uint8_t*>(destDir));
 
     int destIndex = -1;
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(destDir[i].file_name, destFilename.c_str()) == 0 && destDir[i].file_name[0] != '\0') {
-            destIndex = i;
-            break;
-        }
-    }
+    destIndex = this->findEntry(destDirBlock, destFilename);
 
-    if (destIndex == -1) {
+    dir_entry destFileInfo;
+    if (destIndex == -1 || this->readEntry(destDirBlock, destIndex, destFileInfo) != 0) {
         cerr << "[ERROR] Destination file '" << destFilename << "' does not exist.\n";
         return -1;
     }
 
-    dir_entry &destFileInfo = destDir[destIndex];
     if (destFileInfo.type != TYPE_FILE) {
         cerr << "[ERROR] Destination path '" << destFilename << "' is not a file.\n";
         return -1;
     }
 
-    if ((srcDir[srcIndex].access_rights & READ) == 0 || (destDir[destIndex].access_rights & WRITE) == 0) {
+    if ((srcFileInfo.access_rights & READ) == 0 || (destFileInfo.access_rights & WRITE) == 0) {
         cerr << "[ERROR] Access right issue" << endl;
         return -1;
     }
 
 
-    uint32_t newSize = destFileInfo.size + (uint32_t)srcData.size();
-
-    int lastBlock = destFileInfo.first_blk;
-    int blockCount = 0;
-    if (lastBlock == FAT_EOF) {
-    } else {
-        while (lastBlock != FAT_EOF) {
-            lastBlock = this->fat[lastBlock];
-            blockCount++;
-        }
-    }
-
-    int currentBlocks = (destFileInfo.size == 0) ? 0 : (int)((destFileInfo.size + BLOCK_SIZE - 1) / BLOCK_SIZE);
-    int newBlocksNeeded = (newSize == 0) ? currentBlocks : (int)((newSize + BLOCK_SIZE - 1) / BLOCK_SIZE);
-    int additionalBlocksNeeded = newBlocksNeeded - currentBlocks;
-
-
-    int firstBlockOfDest = destFileInfo.first_blk;
-    if (firstBlockOfDest == 0 && destFileInfo.size == 0 && additionalBlocksNeeded > 0) {
-        int startBlockIndex = -1;
-        const int fat_entries = BLOCK_SIZE / 2;
-        for (int i = 2; i < fat_entries; i++) {
-            if (this->fat[i] == FAT_FREE) {
-                startBlockIndex = i;
-                break;
-            }
-        }
-        if (startBlockIndex == -1) {
-            cerr << "[ERROR] No free blocks available for append.\n";
-            return -1;
-        }
-        destFileInfo.first_blk = (uint16_t)startBlockIndex;
-        this->fat[startBlockIndex] = FAT_EOF; 
-        firstBlockOfDest = startBlockIndex;
-        additionalBlocksNeeded = newBlocksNeeded - 1;
+    if ((uint64_t)destFileInfo.size + srcFileInfo.size > UINT32_MAX) {
+        cerr << "[ERROR] File '" << destFilename << "' would grow too large.\n";
+        return -1;
     }
+    uint32_t srcSize = srcFileInfo.size;
+    uint32_t newSize = destFileInfo.size + srcSize;
 
-
-    if (additionalBlocksNeeded > 0) {
-
-        int lastUsedBlock = firstBlockOfDest;
-        if (lastUsedBlock == FAT_EOF || lastUsedBlock == 0) {
-            lastUsedBlock = firstBlockOfDest;
-        } else {
-            int cur = firstBlockOfDest;
-            while (this->fat[cur] != FAT_EOF) {
-                cur = this->fat[cur];
-            }
-            lastUsedBlock = cur;
-        }
-
-        const int fat_entries = BLOCK_SIZE / 2;
-        int currentFatBlock = lastUsedBlock;
-        if (currentFatBlock == 0) {
+    // The source size is taken now, so appending a file to itself copies
+    // it once. Both descriptors are opened before anything is written.
+    int in = this->openEntry(srcDirBlock, srcFilename, OPEN_READ);
+    int out = this->openEntry(destDirBlock, destFilename, OPEN_WRITE | OPEN_APPEND);
+    dirs.release();
+    if (in == -1 || out == -1) {
+        cerr << "[ERROR] Access right issue" << endl;
+        if (in != -1) {
+            this->close(in);
         }
-
-        for (int j = 0; j < additionalBlocksNeeded; j++) {
-            // Find next free block
-            int nextFreeBlock = -1;
-            for (int k = 2; k < fat_entries; k++) {
-                if (this->fat[k] == FAT_FREE) {
-                    nextFreeBlock = k;
-                    break;
-                }
-            }
-            if (nextFreeBlock == -1) {
-                cerr << "[ERROR] Not enough blocks available for appending.\n";
-
-                return -1;
-            }
-
-            if (currentFatBlock == FAT_EOF || currentFatBlock == 0) {
-                // If no blocks were previously assigned
-                destFileInfo.first_blk = (uint16_t)nextFreeBlock;
-                this->fat[nextFreeBlock] = FAT_EOF;
-                currentFatBlock = nextFreeBlock;
-            } else {
-                // Link from the lastUsedBlock
-                this->fat[currentFatBlock] = nextFreeBlock;
-                this->fat[nextFreeBlock] = FAT_EOF;
-                currentFatBlock = nextFreeBlock;
-            }
+        if (out != -1) {
+            this->close(out);
         }
-
-        this->disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(this->fat));
-    }
-
-    int writeBlock = destFileInfo.first_blk;
-    int destFileRemaining = (int)destFileInfo.size;
-
-    while (destFileRemaining > BLOCK_SIZE) {
-        writeBlock = this->fat[writeBlock];
-        destFileRemaining -= BLOCK_SIZE;
+        return -1;
     }
 
-
-    uint8_t blockBuffer[BLOCK_SIZE];
-    if (destFileInfo.size > 0) {
-        this->disk.read(writeBlock, blockBuffer);
-    } else {
-        // File was empty
-        memset(blockBuffer, 0, BLOCK_SIZE);
+    // Allocate the new blocks at once, right after the tail if it is free
+    if (this->preallocate(out, newSize) != 0) {
+        cerr << "[ERROR] Not enough blocks available for appending.\n";
+        this->close(in);
+        this->close(out);
+        return -1;
     }
 
-    // Append data from srcData to the end of dest file
-    int offset = 0; // offset in srcData
-    int remainingAppend = (int)srcData.size();
-
-    // If there's room in the current last block (destFileRemaining < BLOCK_SIZE), fill it first
-    int spaceInBlock = BLOCK_SIZE - destFileRemaining;
-    int toWriteHere = (remainingAppend < spaceInBlock) ? remainingAppend : spaceInBlock;
-    if (toWriteHere > 0) {
-        memcpy(blockBuffer + destFileRemaining, &srcData[offset], toWriteHere);
-        offset += toWriteHere;
-        remainingAppend -= toWriteHere;
-
-        // Write this block back
-        this->disk.write(writeBlock, blockBuffer);
+    vector<uint8_t> buffer(min((uint32_t)STREAM_BYTES, srcSize));
+    uint32_t copied = 0;
+    int64_t n = 0;
+    while (copied < srcSize) {
+        n = this->read(in, buffer.data(), min((uint32_t)buffer.size(), srcSize - copied));
+        if (n <= 0 || this->write(out, buffer.data(), (uint32_t)n) != n) {
+            n = -1;
+            break;
+        }
+        copied += (uint32_t)n;
     }
-
-    // Now if there's still data left, we continue with the next blocks
-    writeBlock = this->fat[writeBlock];
-    while (writeBlock != FAT_EOF && remainingAppend > 0) {
-        int dataSize = (remainingAppend > BLOCK_SIZE) ? BLOCK_SIZE : remainingAppend;
-        memset(blockBuffer, 0, BLOCK_SIZE);
-        memcpy(blockBuffer, &srcData[offset], dataSize);
-        this->disk.write(writeBlock, blockBuffer);
-        offset += dataSize;
-        remainingAppend -= dataSize;
-        writeBlock = this->fat[writeBlock];
+    this->close(in);
+    if (this->close(out) != 0 || n < 0) {
+        cerr << "[ERROR] Could not append to '" << destFilename << "'.\n";
+        return -1;
     }
 
-    // Update the file size in directory
-    destFileInfo.size = newSize;
-    uint8_t dirBuffer[BLOCK_SIZE];
-    memcpy(dirBuffer, destDir, sizeof(destDir));
-    this->disk.write(destDirBlock, dirBuffer);
-
-    disk.read(ROOT_BLOCK, reinterpret_cast<uint8_t*>(root_dir));
-    disk.read(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat));
-
     return 0;
 }
 
 // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
 // in the current directory
 int FS::mkdir(string dirpath) {
+    op_scope op{*this};
 
     string directoryPath;
     string newDirName = dirpath;
@@ -1188,17 +2449,14 @@ int FS::mkdir(string dirpath) {
         cerr << "[ERROR] Failed to resolve directory path.\n";
         return -1;
     }
-
-    // Read the target directory
-    dir_entry currentDir[ROOT_DIR_SIZE];
-    this->disk.read(targetDirBlock, reinterpret_cast<uint8_t*>(currentDir));
+    // the write permission is kept in the parent's entry for the directory
+    int parentBlock = (targetDirBlock == ROOT_BLOCK) ? -1 : this->parentOf(targetDirBlock);
+    dir_guard dirs(*this, targetDirBlock, true, parentBlock, false);
 
     // Check if directory already exists
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(currentDir[i].file_name, newDirName.c_str()) == 0 && currentDir[i].file_name[0] != '\0') {
-            cerr << "[ERROR] Directory '" << newDirName << "' already exists in the target directory.\n";
-            return -1;
-        }
+    if (this->findEntry(targetDirBlock, newDirName) != -1) {
+        cerr << "[ERROR] Directory '" << newDirName << "' already exists in the target directory.\n";
+        return -1;
     }
 
     // Check if the directory has write permissions
@@ -1207,32 +2465,17 @@ int FS::mkdir(string dirpath) {
     if (targetDirBlock == ROOT_BLOCK) {
         writePermission = true;
     } else {
-        int parentBlock = -1;
-        for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-            if (strcmp(currentDir[i].file_name, "..") == 0 && currentDir[i].type == TYPE_DIR) {
-                parentBlock = currentDir[i].first_blk;
-                break;
-            }
-        }
-
         if (parentBlock == -1) {
             cerr << "[ERROR] Could not find the parent directory.\n";
             return -1;
         }
 
-        // Read the parent directory
-        dir_entry parentDir[ROOT_DIR_SIZE];
-        this->disk.read(parentBlock, reinterpret_cast<uint8_t*>(parentDir));
-
-        // In the parent directory, find the entry that references the current directory block
-        for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-            if (parentDir[i].type == TYPE_DIR && parentDir[i].first_blk == (uint16_t)targetDirBlock) {
-                // Check write permission of the current directory as stored in its parent directory entry
-                if ((parentDir[i].access_rights & WRITE) != 0) {
-                    writePermission = true;
-                }
-                break;
-            }
+        // Check write permission of the current directory as stored in its parent directory entry
+        int childSlot = this->findSubdir(parentBlock, targetDirBlock);
+        dir_entry child;
+        if (childSlot != -1 && this->readEntry(parentBlock, childSlot, child) == 0 &&
+            (child.access_rights & WRITE) != 0) {
+            writePermission = true;
         }
     }
 
@@ -1242,65 +2485,40 @@ int FS::mkdir(string dirpath) {
     }
 
 
-    // Find a free block in FAT for the new directory
-    const int fat_entries = BLOCK_SIZE / 2;
-    int freeBlock = -1;
-    for (int i = 2; i < fat_entries; i++) {
-        if (this->fat[i] == FAT_FREE) {
-            freeBlock = i;
-            break;
-        }
+    // Create new directory entry
+    dir_entry newDirEntry;
+    memset(&newDirEntry, 0, sizeof(dir_entry));
+    if (newDirName.length() > sizeof(newDirEntry.file_name) - 1) {
+        cerr << "[ERROR] Directory name too long.\n";
+        return -1;
     }
+
+    // Take a block in the emptiest group for the new directory, it is a
+    // one block directory so the block is marked EOF
+    int freeBlock = this->allocateDirBlock();
     if (freeBlock == -1) {
         cerr << "[ERROR] No free blocks available for new directory.\n";
         return -1;
     }
 
-    // Mark the block as EOF since it's a one block directory
-    this->fat[freeBlock] = FAT_EOF;
-    this->disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(this->fat));
-
     // Find a free entry in the target directory for the new directory
-    int freeIndex = -1;
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (currentDir[i].file_name[0] == '\0' && currentDir[i].first_blk == 0) {
-            freeIndex = i;
-            break;
-        }
-    }
+    int freeIndex = this->findFreeSlot(targetDirBlock);
     if (freeIndex == -1) {
         cerr << "[ERROR] No space in target directory.\n";
-        this->fat[freeBlock] = FAT_FREE;
-        this->disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(this->fat));
-        return -1;
-    }
-
-    // Create new directory entry
-    dir_entry newDirEntry;
-    memset(&newDirEntry, 0, sizeof(dir_entry));
-    if (newDirName.length() > sizeof(newDirEntry.file_name) - 1) {
-        cerr << "[ERROR] Directory name too long.\n";
-        this->fat[freeBlock] = FAT_FREE;
-        this->disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(this->fat));
+        lock_guard<mutex> guard(allocLock);
+        this->fat.set(freeBlock, FAT_FREE);
         return -1;
     }
     strncpy(newDirEntry.file_name, newDirName.c_str(), sizeof(newDirEntry.file_name) - 1);
     newDirEntry.file_name[sizeof(newDirEntry.file_name) - 1] = '\0';
     newDirEntry.size = sizeof(dir_entry) * 1; // at least one entry for '..'
-    newDirEntry.first_blk = (uint16_t)freeBlock;
+    newDirEntry.first_blk = (uint32_t)freeBlock;
     newDirEntry.type = TYPE_DIR;
     newDirEntry.access_rights = READ | WRITE;
 
-    currentDir[freeIndex] = newDirEntry;
-
-    // Update the target directory on disk
-    uint8_t dirBuffer[BLOCK_SIZE] = {0};
-    memcpy(dirBuffer, currentDir, sizeof(currentDir));
-    this->disk.write(targetDirBlock, dirBuffer);
-
-    // Initialize the new directory block
-    dir_entry newDirContent[ROOT_DIR_SIZE];
-    memset(newDirContent, 0, sizeof(newDirContent));
+    // Initialize the new directory block, it is complete before its entry
+    // makes it reachable
+    vector<dir_entry> newDirContent(dirSize, dir_entry());
 
     // '..' entry
     dir_entry dotDotEntry;
@@ -1308,20 +2526,22 @@ int FS::mkdir(string dirpath) {
     strncpy(dotDotEntry.file_name, "..", sizeof(dotDotEntry.file_name) - 1);
     dotDotEntry.file_name[sizeof(dotDotEntry.file_name) - 1] = '\0';
     dotDotEntry.type = TYPE_DIR;
-    dotDotEntry.first_blk = (uint16_t)targetDirBlock;
+    dotDotEntry.first_blk = (uint32_t)targetDirBlock;
     dotDotEntry.access_rights = READ | WRITE;
 
     newDirContent[0] = dotDotEntry;
+    this->writeDir(freeBlock, newDirContent);
 
-    uint8_t newDirBuffer[BLOCK_SIZE] = {0};
-    memcpy(newDirBuffer, newDirContent, sizeof(newDirContent));
-    this->disk.write(freeBlock, newDirBuffer);
+    // Update the target directory on disk
+    this->writeEntry(targetDirBlock, freeIndex, newDirEntry);
 
     return 0;
 }
 
 // cd <dirpath> changes the current (working) directory to the directory named <dirpath>
 int FS::cd(string dirpath) {
+    op_scope op{*this, false};
+    thread_state &t = self();
 
     // If no dirpath provided, do nothing 
     if (dirpath.empty()) {
@@ -1334,22 +2554,18 @@ int FS::cd(string dirpath) {
         return -1;
     }
 
-    // Check if the resolved block is actually a directory
-    dir_entry entries[ROOT_DIR_SIZE];
-    this->disk.read(newDirBlock, reinterpret_cast<uint8_t*>(entries));
-
-    // A valid directory block should have a '..' entry or be the root
+    // Check if the resolved block is actually a directory. A valid
+    // directory block should have a '..' entry or be the root
     bool validDir = false;
     if (newDirBlock == ROOT_BLOCK) {
         // Root is always valid
         validDir = true;
     } else {
-        for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-            if (strcmp(entries[i].file_name, "..") == 0 && entries[i].type == TYPE_DIR) {
-                validDir = true;
-                break;
-            }
-        }
+        dir_guard dirs(*this, newDirBlock, false);
+        int parentSlot = this->findEntry(newDirBlock, "..");
+        dir_entry parent;
+        validDir = parentSlot != -1 && this->readEntry(newDirBlock, parentSlot, parent) == 0 &&
+                   parent.type == TYPE_DIR;
     }
 
     if (!validDir) {
@@ -1358,22 +2574,22 @@ int FS::cd(string dirpath) {
     }
 
     // Update current directory info
-    this->currentBlock = newDirBlock;
+    t.block = newDirBlock;
     // Update the currentDir string
     if (dirpath[0] == '/') {
         // Absolute path
         if (newDirBlock == ROOT_BLOCK) {
-            this->currentDir = "/";
+            t.dir = "/";
         } else {
-            this->currentDir = dirpath;
+            t.dir = dirpath;
         }
     } else {
         // Relative path
         if (newDirBlock == ROOT_BLOCK) {
-            this->currentDir = "/";
+            t.dir = "/";
         } else {
             // Attempt to build a relative path from currentDir
-            if (this->currentDir == "/") {
+            if (t.dir == "/") {
                 
                 auto normalizePath = [&](const string &base, const string &relPath) {
                     vector<string> tokens;
@@ -1416,7 +2632,7 @@ int FS::cd(string dirpath) {
                     return newPath;
                 };
 
-                this->currentDir = normalizePath(this->currentDir, dirpath);
+                t.dir = normalizePath(t.dir, dirpath);
             } else {
                 // We are in some directory other than root
                 // Normalize as above
@@ -1454,11 +2670,106 @@ int FS::cd(string dirpath) {
                     }
                     return newPath;
                 };
-                this->currentDir = normalizePath(this->currentDir, dirpath);
+                t.dir = normalizePath(t.dir, dirpath);
+            }
+        }
+    }
+
+    return 0;
+}
+
+// sync writes all dirty cached blocks back to the disk and empties the
+// journal
+int
+FS::sync()
+{
+    op_scope op{*this, false, true};
+    if (commit() != 0 || journal.checkpoint() != 0) {
+        cerr << "[ERROR] sync failed: could not write back all blocks.\n";
+        return -1;
+    }
+    return 0;
+}
+
+// frag [filepath] prints how many blocks and fragments a file, or every file
+// in the current directory, has
+int
+FS::frag(string filepath)
+{
+    op_scope op{*this, false};
+    string directoryPath;
+    string filename = filepath;
+    size_t lastSlash = filepath.find_last_of('/');
+    if (lastSlash != string::npos) {
+        directoryPath = (lastSlash == 0) ? "/" : filepath.substr(0, lastSlash);
+        filename = filepath.substr(lastSlash + 1);
+    }
+    int dirBlock = resolvePathToDirectory(directoryPath);
+    if (dirBlock == -1) {
+        cerr << "[ERROR] frag failed: directory path could not be resolved.\n";
+        return -1;
+    }
+    dir_guard dirs(*this, dirBlock, false);
+
+    bool found = false;
+    cout << "name\t\tblocks\t\tfragments\n";
+    this->streamDir(dirBlock, [&](const dir_entry *entries, int count) {
+        for (int i = 0; i < count; i++) {
+            if (entries[i].file_name[0] == '\0' || entries[i].file_name[0] == INLINE_MARK ||
+                entries[i].type != TYPE_FILE) {
+                continue;
+            }
+            if (!filename.empty() && strcmp(entries[i].file_name, filename.c_str()) != 0) {
+                continue;
             }
+            int blocks = (entries[i].first_blk == INLINE_BLK) ? 0 : max(1, (int)((entries[i].size + blockSize - 1) / blockSize));
+            cout << entries[i].file_name << "\t\t" << blocks << "\t\t" << countFragments(entries[i].first_blk) << "\n";
+            found = true;
         }
+        return true;
+    });
+    if (!filename.empty() && !found) {
+        cerr << "[ERROR] File '" << filename << "' not found.\n";
+        return -1;
     }
+    return 0;
+}
+
+// df prints the size of the volume and how much of it is free
+int
+FS::df()
+{
+    op_scope op{*this, false};
+    uint64_t total = sb.no_blocks - sb.data_start;
+    uint64_t free = this->fat.get_no_free();
+    cout << "block size\tblocks\t\tused\t\tfree\t\tuse%\n";
+    cout << sb.block_size << "\t\t" << total << "\t\t" << total - free << "\t\t" << free << "\t\t"
+         << (total ? (total - free) * 100 / total : 0) << "%\n";
+    cout << "free: " << free * sb.block_size << " of " << total * sb.block_size << " bytes\n";
+    return 0;
+}
 
+// stats prints the I/O counters and operation latencies, as a table or as
+// JSON ("json"), "reset" clears them
+int
+FS::stats(string mode)
+{
+    op_scope op{*this, false, true};
+    lock_guard<mutex> guard(latencyLock);
+    if (mode == "reset") {
+        disk.reset_stats();
+        cache.reset_stats();
+        for (auto &h : opLatency) {
+            h = latency_histogram();
+        }
+    } else if (mode == "json") {
+        print_stats_json(cout, disk.get_stats(), cache.get_stats(), opLatency);
+    } else if (mode.empty()) {
+        print_stats(cout, disk.get_stats(), cache.get_stats(), opLatency);
+    } else {
+        cerr << "[ERROR] Unknown stats mode '" << mode << "'.\n";
+        return -1;
+    }
     return 0;
 }
 
@@ -1467,7 +2778,8 @@ int FS::cd(string dirpath) {
 int
 FS::pwd()
 {
-    cout << this->currentDir << endl;
+    op_scope op{*this, false};
+    cout << self().dir << endl;
     return 0;
 }
 
@@ -1475,6 +2787,7 @@ FS::pwd()
 // file <filepath> to <accessrights>.
 int FS::chmod(string accessrights, string filepath)
 {
+    op_scope op{*this};
     // Helper to separate path into directory and filename
     auto separatePath = [&](const string &fullPath) {
         string directoryPath;
@@ -1498,24 +2811,22 @@ int FS::chmod(string accessrights, string filepath)
         cerr << "[ERROR] chmod failed: directory path could not be resolved.\n";
         return -1;
     }
-
-    dir_entry dirEntries[ROOT_DIR_SIZE];
-    this->disk.read(dirBlock, reinterpret_cast<uint8_t*>(dirEntries));
+    dir_guard dirs(*this, dirBlock, true);
 
     int fileIndex = -1;
-    for (int i = 0; i < ROOT_DIR_SIZE; i++) {
-        if (strcmp(dirEntries[i].file_name, filename.c_str()) == 0 && dirEntries[i].file_name[0] != '\0') {
-            fileIndex = i;
-            break;
-        }
-    }
+    fileIndex = this->findEntry(dirBlock, filename);
 
-    if (fileIndex == -1) {
+    dir_entry targetEntry;
+    if (fileIndex == -1 || this->readEntry(dirBlock, fileIndex, targetEntry) != 0) {
         cerr << "[ERROR] File '" << filename << "' not found.\n";
         return -1;
     }
-
-    dir_entry &targetEntry = dirEntries[fileIndex];
+    // close would write the old rights back, and a descriptor keeps the
+    // rights it was opened with
+    if (this->isOpen(dirBlock, fileIndex)) {
+        cerr << "[ERROR] File '" << filename << "' is open.\n";
+        return -1;
+    }
 
     // Parse accessrights string
     uint8_t newRights = 0;
@@ -1544,13 +2855,8 @@ int FS::chmod(string accessrights, string filepath)
 
     targetEntry.access_rights = newRights;
 
-    // Write updated directory entries to disk
-    uint8_t buffer[BLOCK_SIZE];
-    memcpy(buffer, dirEntries, sizeof(dirEntries));
-    this->disk.write(dirBlock, buffer);
-
-    disk.read(ROOT_BLOCK, reinterpret_cast<uint8_t*>(root_dir));
-    disk.read(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat));
+    // Write the updated entry to disk
+    this->writeEntry(dirBlock, fileIndex, targetEntry);
 
     return 0;
 }
@@ -4,59 +4,448 @@
 #include <cstring>
 #include <string>
 #include "disk.h"
+#include "cache.h"
+#include "fat.h"
+#include "journal.h"
 #include <vector>
 #include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <functional>
+#include <cstdio>
+#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <thread>
 
 
 #ifndef __FS_H__
 #define __FS_H__
 
-#define ROOT_BLOCK 0
-#define FAT_BLOCK 1
-#define FAT_FREE 0
-#define FAT_EOF -1
+// on-disk layout: the superblock, the root directory, the FAT (as many
+// blocks as the volume size needs), the block reference counts (as big as
+// the FAT), the journal and then the data blocks
+#define SUPER_BLOCK 0
+#define ROOT_BLOCK 1
+#define FAT_BLOCK 2
+
+#define FS_MAGIC 0x54414653 // "SFAT"
+#define FS_VERSION 5
+// smallest volume format accepts, in blocks
+#define MIN_NO_BLOCKS 64
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
+
+// A file of at most INLINE_MAX bytes keeps its data in the directory
+// instead of a block: first_blk is INLINE_BLK and the data fills the slots
+// right after the entry, in the same directory block. Those slots start
+// with INLINE_MARK, which no name can, and hold INLINE_SLOT_BYTES each.
+// Volumes of version 4 and later only.
+#define INLINE_BLK UINT32_MAX
+#define INLINE_MARK '/'
+#define INLINE_SLOT_BYTES 63
+#define INLINE_MAX (4 * INLINE_SLOT_BYTES)
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
 
-#define ROOT_DIR_SIZE 64
+// longest run of consecutive blocks moved by a single disk call, in bytes
+#define MAX_RUN_BYTES (256 * 1024)
+
+// flags of FS::open
+#define OPEN_READ 1
+#define OPEN_WRITE 2
+#define OPEN_CREATE 4 // creates the file if it does not exist
+#define OPEN_APPEND 8 // every write goes to the end of the file
+
+// bytes moved per read or write call when a command streams a file
+#define STREAM_BYTES (1024 * 1024)
+
+// most (directory, name) pairs kept by the dentry cache
+#define DENTRY_CACHE_MAX 65536
+// most file chains whose length and last block are remembered
+#define CHAIN_CACHE_MAX 65536
+// a file's chain is sampled every CHAIN_SKIP blocks, so reaching any
+// position takes at most CHAIN_SKIP - 1 FAT lookups once it was walked
+#define CHAIN_SKIP 64
+
+// the data area is split into groups of this many bytes. Directories are
+// spread over the groups and files are placed in their directory's group.
+#define GROUP_BYTES (8 * 1024 * 1024)
+
+// durability modes, picked with the FS_DURABILITY environment variable. A
+// commit logs the FAT and every dirty block in the journal with one write
+// and one flush (or writes them back in place on a volume without one), so
+// the image is consistent after each one.
+#define DURABILITY_NONE 0 // commits only on sync and quit
+#define DURABILITY_OP 1 // a commit at the end of every modifying command
+#define DURABILITY_PERIODIC 2 // a commit at the end of the first modifying
+                              // command FS_COMMIT_MS after the last one
+#define COMMIT_INTERVAL_MS 1000
 
 using namespace std;
 
+struct superblock {
+    uint32_t magic; // FS_MAGIC
+    uint32_t version; // FS_VERSION
+    uint32_t block_size; // size of a block in bytes
+    uint32_t no_blocks; // size of the volume in blocks
+    uint32_t fat_start; // first block of the FAT
+    uint32_t fat_blocks; // number of blocks of the FAT
+    uint32_t data_start; // first block that can be allocated
+    uint32_t ref_start; // first block of the reference counts
+    uint32_t ref_blocks; // number of blocks of the reference counts, 0 on
+                         // version 2 volumes, which cannot share blocks
+    uint32_t journal_start; // first block of the journal
+    uint32_t journal_blocks; // number of blocks of the journal, 0 before
+                             // version 5
+};
+
 struct dir_entry {
-    char file_name[56]; // name of the file / sub-directory
-    uint32_t size; // size of the file in bytes
-    uint16_t first_blk; // index in the FAT for the first block of the file
+    char file_name[54]; // name of the file / sub-directory
     uint8_t type; // directory (1) or file (0)
     uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
+    uint32_t size; // size of the file in bytes
+    uint32_t first_blk; // index in the FAT for the first block of the file
 };
+static_assert(sizeof(dir_entry) == 64, "a directory block holds block_size / 64 entries");
 
+// FS is safe to use from several threads at once:
+// - every command holds volumeLock shared; commits, format, stats, sync and
+//   the removal of a directory hold it alone
+// - each directory block has a reader-writer lock. A command resolves its
+//   paths first, locking one directory at a time, and then holds the locks
+//   of the few directories it reads or changes (dir_guard), taken in block
+//   order so that no two commands wait for each other
+// - allocLock covers finding free blocks and taking them, and the block
+//   reference counts
+// - the FAT, the block cache and the caches in memory below have short
+//   locks of their own
+// Each thread has its own working directory. A descriptor is used by one
+// thread at a time, and an open file can not be removed, moved or
+// chmodded.
 class FS {
 private:
     Disk disk;
-    // size of a FAT entry is 2 bytes
-    int16_t fat[BLOCK_SIZE / 2];
+    // every block access goes through the cache, declared after disk so it
+    // is destroyed (and written back) first
+    BlockCache cache{disk};
+    // volume geometry, read from the superblock
+    superblock sb;
+    // the FAT is paged in through the cache on demand, entries are 4 bytes
+    FatTable fat{cache};
+    // extra references to each block, 0 if a single file uses it. A file
+    // made by cp shares the blocks of its source until one of them writes.
+    // Sharing runs to the end of a chain, as both chains meet in the blocks
+    // after a shared one.
+    FatTable refs{cache, FAT_CACHE_PAGES, false};
+    bool reflinks() { return sb.ref_blocks != 0; }
+    // metadata changes reach the disk through the journal, see journal.h
+    Journal journal{cache};
+
+    // block size of the volume and the number of entries in a directory block
+    int blockSize = DEFAULT_BLOCK_SIZE;
+    int dirSize = DEFAULT_BLOCK_SIZE / sizeof(dir_entry);
 
-    // Root directory init
-    dir_entry root_dir[ROOT_DIR_SIZE];
+    // name index of a directory block, built on the first lookup and kept
+    // up to date by writeEntry
+    struct dir_index {
+        vector<int> blocks; // the directory's chain, slot i is in blocks[i / dirSize]
+        unordered_map<string, int> slots; // name -> slot
+        unordered_map<uint32_t, int> subdirs; // first block -> slot, without ".."
+        vector<string> names; // slot -> name, empty if the slot is unused
+        set<int> free_slots; // lowest first
+    };
+    unordered_map<int, dir_index> dirIndex;
+    // guards dirIndex and dentries. The index of a directory is built under
+    // it and then read or changed under the directory's lock.
+    recursive_mutex indexLock;
 
-    string currentDir = "";
-    int currentBlock; 
-    int current_directory_block;
+    // dentry cache used by path resolution: directory block -> name -> the
+    // directory block the name refers to, or -1 if it is not a directory
+    // there. Entries go away when writeEntry changes the name.
+    unordered_map<int, unordered_map<string, int>> dentries;
+    size_t noDentries = 0;
+    bool lookupDentry(int block, const string &name, int &child);
+    void addDentry(int block, const string &name, int child);
+    // the name index of a directory, built from its blocks on first use
+    dir_index &indexFor(int block);
+    void indexSlot(dir_index &index, int slot, const dir_entry &entry);
+
+    // Root directory (all blocks of its chain), read at mount and written
+    // back at commit. rootDirty holds the positions in the chain of the
+    // blocks changed since the last commit.
+    vector<dir_entry> root_dir;
+    set<int> rootDirty;
+
+    int durability = DURABILITY_OP;
+    chrono::milliseconds commitInterval{COMMIT_INTERVAL_MS};
+    atomic<chrono::steady_clock::time_point> lastCommit;
+    // commands finished so far, and how many of them the last commit covers
+    atomic<uint64_t> opsDone{0};
+    atomic<uint64_t> opsCommitted{0};
+    // group commit: a command that ends while no commit runs commits for
+    // every command that ended before, the others wait for that commit
+    // (commitDone) instead of taking volumeLock one after another
+    mutex commitLock;
+    condition_variable commitDone;
+    bool committing = false;
+
+    shared_mutex volumeLock;
+    // one lock per directory block, see above. They are never freed, a
+    // block that holds a directory again gets its old lock.
+    unordered_map<int, unique_ptr<shared_mutex>> dirLocks;
+    mutex dirLocksLock;
+    shared_mutex &dirLock(int block);
+    mutex allocLock;
+
+    // working directory of a thread and the commands it has in progress.
+    // It is thread_local, kept per FS by id, and goes away with its thread.
+    struct thread_state {
+        string dir = "/";
+        int block = ROOT_BLOCK;
+        // directory the last path resolved to, cat looks there
+        int resolved = ROOT_BLOCK;
+        int depth = 0;
+        bool modified = false;
+        uint64_t formats = 0; // the format the directory belongs to
+    };
+    // tells FS instances apart, unlike addresses ids are not reused
+    const uint64_t id;
+    // formats so far, each one sends every thread back to the root directory
+    atomic<uint64_t> formats{0};
+    thread_state &self();
+
+    // a command in progress. The outermost command of a thread holds
+    // volumeLock, shared or alone, and once it ends the commands that
+    // changed something commit as the durability mode asks.
+    class op_scope {
+        FS &fs;
+        thread_state &state;
+        shared_lock<shared_mutex> shared;
+        unique_lock<shared_mutex> alone;
+    public:
+        op_scope(FS &fs, bool modifying = true, bool exclusive = false);
+        ~op_scope();
+        // for a command that only knows on the way whether it changes anything
+        void changed() { state.modified = true; }
+    };
+    // holds the locks of up to three directories for a command, shared or
+    // exclusive, taken in block order. -1 stands for no directory.
+    class dir_guard {
+        FS &fs;
+        vector<pair<int, bool>> held; // block, exclusive
+    public:
+        dir_guard(FS &fs, int block, bool exclusive, int block2 = -1, bool exclusive2 = false,
+                  int block3 = -1, bool exclusive3 = false);
+        ~dir_guard() { release(); }
+        void release();
+    };
+    // logs the FAT and all dirty blocks in the journal, or writes them
+    // back, and flushes the disk. Called with volumeLock held alone.
+    int commit();
+
+    // times an operation from construction to destruction
+    latency_histogram opLatency[OP_COUNT];
+    mutex latencyLock;
+    struct op_timer {
+        FS &fs;
+        int op;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        // starts over, e.g. after waiting for user input
+        void restart() { start = chrono::steady_clock::now(); }
+        // leaves out time spent on something else, e.g. user input
+        void exclude(chrono::steady_clock::duration d) { start += d; }
+        ~op_timer() {
+            auto us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+            lock_guard<mutex> guard(fs.latencyLock);
+            fs.opLatency[op].add((uint64_t)us.count());
+        }
+    };
+    // commits unless a commit after command number done covered it already
+    void endOp(uint64_t done);
+
+    // returns the first free block at or after from, -1 if there is none
+    int findFreeBlock(int from);
+    // A directory is a FAT chain of blocks of dirSize entries each, slot i
+    // lives in block i / dirSize of the chain.
+    vector<int> dirChain(int block);
+    // Commands touch a directory one entry at a time: findEntry gives the
+    // slot, the cached chain its block, and only that block is read or
+    // written. The root directory is served from root_dir.
+    // block holding slot, -1 if the directory has no such slot
+    int slotBlock(int block, int slot);
+    // reads count entries from slot on, which lie in one block
+    int readEntries(int block, int slot, int count, dir_entry *entries);
+    // writes a whole new directory, its index is rebuilt on next use
+    int writeDir(int block, vector<dir_entry> &entries);
+    // calls fn with the entries of each block of the directory in turn
+    // through a one block buffer, until fn returns false
+    int streamDir(int block, const function<bool(const dir_entry *entries, int count)> &fn);
+    // adds an empty block to the end of the directory, returns its first
+    // slot or -1 if the volume is full
+    int growDir(int block);
+    // writes the single entry in slot of a directory
+    int writeEntry(int block, int slot, const dir_entry &entry);
+    // keeps the name index and the dentry cache in step with a slot change
+    void slotChanged(int block, int slot, const dir_entry &entry);
+    // forgets the name index and the dentries of a directory block that is freed
+    void dropIndex(int block);
+    // inline files, see INLINE_BLK
+    bool inlining() { return sb.version >= 4; }
+    static int inlineSlots(uint32_t size) { return (int)((size + INLINE_SLOT_BYTES - 1) / INLINE_SLOT_BYTES); }
+    // the data of the inline file in slot
+    string readInline(int block, int slot, uint32_t size);
+    // writes the entry of an inline file to slot and data after it
+    int writeInline(int block, int slot, const dir_entry &entry, const string &data);
+    // empties count slots from slot on
+    void clearSlots(int block, int slot, int count);
+    // lowest slot starting count free slots in one directory block, the
+    // directory grows by a block if there is none. -1 if the volume is full.
+    int findFreeRun(int block, int count);
+    // slot of the entry called name in the directory, -1 if none. Only the
+    // name index is used, readEntry then reads the block holding the slot.
+    int findEntry(int block, const string &name);
+    // reads the entry in slot of a directory
+    int readEntry(int block, int slot, dir_entry &entry);
+    // lowest free slot of the directory, which grows by a block when it is
+    // full. -1 if the volume is full too.
+    int findFreeSlot(int block);
+    // slot of the sub-directory starting at child, -1 if none
+    int findSubdir(int block, int child);
+    // block of the parent of a directory, from its ".." entry, -1 if none
+    int parentOf(int block);
+    // block of the sub-directory called name, -1 if there is none
+    int subdirNamed(int block, const string &name);
+    // switches the disk, cache and directory size to a new block size
+    int setBlockSize(uint32_t block_size, unsigned no_blocks = 0);
+    int maxRunBlocks() { return max(1, MAX_RUN_BYTES / blockSize); }
+
+    // placement groups, see GROUP_BYTES
+    int groupBlocks() { return max(MIN_NO_BLOCKS, GROUP_BYTES / blockSize); }
+    int groupOf(int block);
+    // returns a block for a new directory in the group with the most free
+    // blocks, marked EOF, -1 if the volume is full
+    int allocateDirBlock();
+    // smallest free extent of at least needed blocks in [from, to), -1 if
+    // there is none. Adds every extent seen to seen if given.
+    int bestFit(int from, int to, int needed, vector<pair<int, int>> *seen);
+    // allocates nblocks blocks as a new chain, preferring to start at goal
+    // and then best fit in the group of near. Returns the first block, -1
+    // if there is no space
+    int allocateChain(int nblocks, int goal = -1, int near = -1);
+    // number of runs of consecutive blocks in the chain at first_blk
+    int countFragments(int first_blk);
+    // gives freed blocks back to the host file system, one hole per run
+    void discardBlocks(vector<int> blocks);
+    // blocks freed since the last commit. The committed metadata may still
+    // point at them, so they stay out of the free-space bitmap and are only
+    // discarded and released once the commit is on disk. Guarded by
+    // allocLock.
+    set<int> freedBlocks;
+    // frees the chain starting at first_blk, its blocks are discarded
+    // after the next commit
+    void freeChain(int first_blk);
+
+    // a file that is open, shared by all its descriptors. The directory
+    // entry is copied at the first open, changed in place by writes and
+    // written back by close. lock serializes the reads and writes of the
+    // file, it is taken after the directory locks and before the others.
+    struct open_file {
+        mutex lock;
+        int dirBlock;
+        int slot;
+        dir_entry entry;
+        int nblocks = -1; // length of the chain, -1 until a write needs it
+        int last = -1; // last block of the chain
+        uint32_t curIdx = 0; // chain position of curBlock, the walk cursor
+        int curBlock = -1;
+        uint32_t owned = 0; // leading blocks known not to be shared
+        bool dirty = false;
+        bool inlined = false; // the data is in data, not in a chain
+        string data;
+        int dataSlots = 0; // slots after the entry the data takes on disk
+        int refs = 0; // descriptors, guarded by handleLock
+    };
+    // the open files by directory block and slot
+    map<pair<int, int>, shared_ptr<open_file>> openFiles;
+    struct file_handle {
+        shared_ptr<open_file> file;
+        int flags;
+        uint32_t pos = 0;
+    };
+    unordered_map<int, file_handle> handles;
+    int nextFd = 0;
+    // guards handles, openFiles and the refs of the open files, nothing
+    // else is locked while it is held
+    mutex handleLock;
+    file_handle *handleFor(int fd);
+    // forgets fd, and its open file with the last descriptor
+    void forgetHandle(int fd);
+    // true if a descriptor has the file in slot of the directory open
+    bool isOpen(int dirBlock, int slot);
+    // length, last block and known unshared blocks of the file chains that
+    // handles have walked, by first block. A file opened again, e.g. by
+    // the next append, starts from there instead of walking its chain.
+    struct chain_info {
+        int nblocks = -1;
+        int last = -1;
+        uint32_t owned = 0;
+        vector<int> skip; // skip[j] is the block at position j * CHAIN_SKIP
+    };
+    unordered_map<uint32_t, chain_info> chains;
+    mutex chainLock;
+    // called with chainLock held
+    chain_info &chainFor(uint32_t first_blk);
+    void rememberChain(const open_file &f);
+    // opens the file called name in a directory, see open
+    int openEntry(int dirBlock, const string &name, int flags);
+    // block at position idx of the file's chain, -1 past its end
+    int blockAt(open_file &f, uint32_t idx);
+    // closes fd and removes its file, after a write that ran out of space
+    void abandon(int fd);
+    // makes the file's chain at least nblocks long, the missing blocks are
+    // allocated at once, right after the last block if possible
+    int reserve(open_file &f, int nblocks);
+    // gives the file its own copy of every shared block up to position
+    // upto, leaving the blocks at [skipFrom, skipTo) uninitialised as the
+    // caller overwrites them
+    int unshare(open_file &f, int upto, int skipFrom = 0, int skipTo = 0);
+    // moves the data of an inline file into a chain
+    int spill(open_file &f);
+    // gets the file open as fd ready to grow to size bytes, by allocating
+    // its blocks at once unless the data fits inline
+    int preallocate(int fd, uint32_t size);
+    // stores an inline file in its directory at close, -1 if it has to go
+    // to a chain
+    int storeInline(open_file &f);
+    // rm, a directory is only removed with volumeLock held alone. Returns
+    // RM_DIRECTORY for one if alone is not set.
+    static const int RM_DIRECTORY = -2;
+    int removeEntry(const string &filepath, bool alone);
 
 public:
     FS();
     ~FS();
-    // formats the disk, i.e., creates an empty file system
-    int format();
+    // true if the disk holds a file system (a valid superblock)
+    bool formatted() { return sb.magic == FS_MAGIC; }
+    // formats the disk, i.e., creates an empty file system. volume_size is
+    // the size of the volume in bytes, 0 keeps the current size of the disk.
+    // block_size must be a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE,
+    // 0 keeps the current block size
+    int format(uint64_t volume_size = 0, uint32_t block_size = 0);
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
     int create(std::string filepath);
-    // cat <filepath> reads the content of a file and prints it on the screen
-    int cat(std::string filepath);
+    // cat <filepath> [offset len] reads the content of a file, or len bytes
+    // of it from offset on, and prints it on the screen
+    int cat(std::string filepath, uint64_t offset = 0, uint64_t len = UINT64_MAX);
     // ls lists the content in the current directory (files and sub-directories)
     int ls();
 
@@ -81,10 +470,32 @@ public:
     // directory, including the current directory name
     int pwd();
 
+    // sync writes all dirty cached blocks back to the disk
+    int sync();
+    // frag [filepath] prints how many blocks and fragments (runs of
+    // consecutive blocks) a file, or every file in the current directory, has
+    int frag(std::string filepath);
+    // df prints the size of the data area and how much of it is free
+    int df();
+    // stats prints the I/O counters and operation latencies, as a table or
+    // as JSON ("json"), "reset" clears them
+    int stats(std::string mode);
+
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
 
+    // Handle API. open returns a descriptor for the file <filepath> (flags
+    // are OPEN_*), or -1. read and write move up to len bytes at the
+    // current position, block by block, and return how many they moved or
+    // -1. seek sets the position like lseek. close writes the directory
+    // entry back if the file changed.
+    int open(std::string filepath, int flags);
+    int64_t read(int fd, uint8_t *buf, uint32_t len);
+    int64_t write(int fd, const uint8_t *buf, uint32_t len);
+    int64_t seek(int fd, int64_t offset, int whence);
+    int close(int fd);
+
     int resolvePathToDirectory(const string &path);
 };
 
@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include "journal.h"
+
+// number of blocks format gives the journal
+unsigned
+Journal::blocks_for(unsigned no_blocks, unsigned block_size)
+{
+    unsigned n = std::min(JOURNAL_BYTES / block_size, no_blocks / 16);
+    return std::max(n, (unsigned)JOURNAL_MIN_BLOCKS);
+}
+
+// FNV-1a, enough to tell a torn record from a complete one
+uint64_t
+Journal::checksum(const uint8_t *data, size_t len)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// reads / writes count log blocks from position pos on, at most two runs
+int
+Journal::transfer(bool write, unsigned pos, unsigned count, uint8_t *buf)
+{
+    size_t bs = cache.get_block_size();
+    while (count > 0) {
+        unsigned n = std::min(count, log_blocks() - pos);
+        int ret = write ? cache.write_run(start + 1 + pos, n, buf) : cache.read_run(start + 1 + pos, n, buf);
+        if (ret != 0)
+            return -1;
+        buf += n * bs;
+        count -= n;
+        pos = 0;
+    }
+    return 0;
+}
+
+// writes the header for a log that starts at head, and flushes
+int
+Journal::write_header()
+{
+    std::vector<uint8_t> block(cache.get_block_size(), 0);
+    journal_header h = { JOURNAL_MAGIC, head, seq };
+    memcpy(block.data(), &h, sizeof(h));
+    if (cache.write_run(start, 1, block.data()) != 0)
+        return -1;
+    return cache.flush();
+}
+
+// starts an empty journal in the area of a new volume
+int
+Journal::format(unsigned start, unsigned no_blocks)
+{
+    this->start = start;
+    this->no_blocks = no_blocks;
+    head = 0;
+    used = 0;
+    seq = 1;
+    images.clear();
+    cache.set_journaled(true);
+    return write_header();
+}
+
+void
+Journal::detach()
+{
+    cache.set_journaled(false);
+    start = 0;
+    no_blocks = 0;
+    images.clear();
+}
+
+// replays the complete records from the tail on. A block revoked by a
+// record is not written from the records before it.
+int
+Journal::attach(unsigned start, unsigned no_blocks)
+{
+    this->start = start;
+    this->no_blocks = no_blocks;
+    size_t bs = cache.get_block_size();
+    std::vector<uint8_t> block(bs);
+    if (cache.read_run(start, 1, block.data()) != 0)
+        return -1;
+    journal_header h;
+    memcpy(&h, block.data(), sizeof(h));
+    head = 0;
+    seq = 1;
+    if (h.magic == JOURNAL_MAGIC && h.tail < log_blocks()) {
+        head = h.tail;
+        seq = h.seq;
+    }
+
+    // find the complete records and the highest record revoking each block
+    std::vector<std::vector<uint8_t>> records;
+    std::unordered_map<unsigned, uint64_t> revoked_by;
+    unsigned scanned = 0;
+    while (scanned < log_blocks()) {
+        if (transfer(false, head, 1, block.data()) != 0)
+            break;
+        journal_record r;
+        memcpy(&r, block.data(), sizeof(r));
+        uint64_t tags = (uint64_t)r.no_logged + r.no_revoked;
+        if (r.magic != JOURNAL_MAGIC || r.seq != seq || r.desc_blocks == 0 ||
+            (uint64_t)r.desc_blocks * bs < sizeof(r) + tags * sizeof(uint32_t) ||
+            (uint64_t)r.desc_blocks + r.no_logged > log_blocks() - scanned)
+            break;
+        unsigned len = r.desc_blocks + r.no_logged;
+        std::vector<uint8_t> rec((size_t)len * bs);
+        if (transfer(false, head, len, rec.data()) != 0 ||
+            checksum(rec.data() + sizeof(r), rec.size() - sizeof(r)) != r.checksum)
+            break;
+        const uint32_t *tag = reinterpret_cast<const uint32_t*>(rec.data() + sizeof(r));
+        for (uint32_t i = 0; i < r.no_revoked; i++)
+            revoked_by[tag[r.no_logged + i]] = seq;
+        records.push_back(std::move(rec));
+        head = (head + len) % log_blocks();
+        scanned += len;
+        seq++;
+    }
+
+    // write the images home, oldest first
+    int ret = 0;
+    uint64_t first_seq = seq - records.size();
+    for (size_t k = 0; k < records.size(); k++) {
+        uint8_t *rec = records[k].data();
+        journal_record r;
+        memcpy(&r, rec, sizeof(r));
+        const uint32_t *tag = reinterpret_cast<const uint32_t*>(rec + sizeof(r));
+        for (uint32_t i = 0; i < r.no_logged; i++) {
+            auto it = revoked_by.find(tag[i]);
+            if (it != revoked_by.end() && it->second > first_seq + k)
+                continue;
+            if (cache.write(tag[i], rec + (size_t)(r.desc_blocks + i) * bs) != 0)
+                ret = -1;
+        }
+    }
+    if (cache.sync() != 0)
+        ret = -1;
+
+    used = 0;
+    images.clear();
+    cache.set_journaled(true);
+    if (write_header() != 0 || ret != 0)
+        return -1;
+    return (int)records.size();
+}
+
+// appends the unlogged dirty blocks as one record
+int
+Journal::commit()
+{
+    if (!active())
+        return cache.sync();
+    std::vector<unsigned> logged = cache.get_unlogged();
+    std::vector<unsigned> revoked = cache.take_revoked();
+    if (logged.empty() && revoked.empty())
+        return cache.flush();
+
+    size_t bs = cache.get_block_size();
+    size_t tags = logged.size() + revoked.size();
+    unsigned desc_blocks = (unsigned)((sizeof(journal_record) + tags * sizeof(uint32_t) + bs - 1) / bs);
+    unsigned len = desc_blocks + (unsigned)logged.size();
+    if (len > log_blocks()) {
+        // written in place, as on a volume without a journal
+        if (cache.sync() != 0)
+            return -1;
+        return checkpoint();
+    }
+    if (used + len > log_blocks() && checkpoint() != 0)
+        return -1;
+
+    std::vector<uint8_t> rec((size_t)len * bs, 0);
+    journal_record r = { JOURNAL_MAGIC, desc_blocks, seq, (uint32_t)logged.size(), (uint32_t)revoked.size(), 0 };
+    uint32_t *tag = reinterpret_cast<uint32_t*>(rec.data() + sizeof(r));
+    for (size_t i = 0; i < logged.size(); i++) {
+        tag[i] = logged[i];
+        if (cache.read(logged[i], rec.data() + (desc_blocks + i) * bs) != 0)
+            return -1;
+    }
+    std::copy(revoked.begin(), revoked.end(), tag + logged.size());
+    r.checksum = checksum(rec.data() + sizeof(r), rec.size() - sizeof(r));
+    memcpy(rec.data(), &r, sizeof(r));
+
+    // file data written before the commit is on the disk before the record
+    if (cache.flush() != 0 || transfer(true, head, len, rec.data()) != 0 || cache.flush() != 0)
+        return -1;
+    cache.mark_logged(logged);
+    for (size_t i = 0; i < logged.size(); i++)
+        images[logged[i]] = (unsigned)((head + desc_blocks + i) % log_blocks());
+    head = (head + len) % log_blocks();
+    used += len;
+    seq++;
+    return 0;
+}
+
+// writes every logged block home and empties the log. The committed image
+// of a block that is dirty again comes from the log, the cache only holds
+// contents that are not committed yet.
+int
+Journal::checkpoint()
+{
+    if (!active())
+        return 0;
+    std::vector<uint8_t> block(cache.get_block_size());
+    for (unsigned block_no : cache.get_relogged()) {
+        auto it = images.find(block_no);
+        if (it == images.end())
+            continue;
+        if (transfer(false, it->second, 1, block.data()) != 0 || cache.write_home(block_no, block.data()) != 0)
+            return -1;
+    }
+    // cache.checkpoint flushes the images written above too
+    if (cache.checkpoint() != 0)
+        return -1;
+    images.clear();
+    used = 0;
+    return write_header();
+}
@@ -0,0 +1,82 @@
+// journal.h is the header file for the Journal class, a write-ahead log of
+// metadata blocks kept in a circular area of the volume.
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "cache.h"
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#define JOURNAL_MAGIC 0x4C4E524A // "JRNL"
+// size of the journal format creates, at most a sixteenth of the volume
+#define JOURNAL_BYTES (4 * 1024 * 1024)
+#define JOURNAL_MIN_BLOCKS 8
+
+// The first block of the journal area holds the header, the rest is the log.
+// A commit appends one record to the log: descriptor blocks (the record
+// header and the tags, i.e. block numbers) followed by the images of the
+// logged blocks, written with one sequential disk call and one flush. The
+// logged blocks then reach their home location whenever the cache writes
+// them back, and a checkpoint writes the rest home once the log is full. A
+// logged block dirtied again since has its committed image only in the log,
+// the checkpoint copies that image home before the log is reused.
+//
+// Records carry increasing sequence numbers and a checksum, so replay stops
+// at the first record that is stale or torn. A logged block that is later
+// overwritten in place or freed is revoked by the next record, replay does
+// not write its older images.
+struct journal_header {
+    uint32_t magic; // JOURNAL_MAGIC
+    uint32_t tail; // log position of the oldest record still needed
+    uint64_t seq; // sequence number of the record at tail
+};
+
+struct journal_record {
+    uint32_t magic; // JOURNAL_MAGIC
+    uint32_t desc_blocks; // blocks of this header and the tags
+    uint64_t seq;
+    uint32_t no_logged; // tags of the logged blocks, in the order of their images
+    uint32_t no_revoked; // tags of the revoked blocks, after the logged ones
+    uint64_t checksum; // of everything in the record after this header
+};
+
+class Journal {
+private:
+    BlockCache &cache;
+    unsigned start = 0; // first block of the journal area, 0 if none
+    unsigned no_blocks = 0;
+    unsigned head = 0; // log position of the next record
+    unsigned used = 0; // log blocks from the tail to head
+    uint64_t seq = 1; // sequence number of the next record
+    // log position of the newest image of each block logged since the last
+    // checkpoint
+    std::unordered_map<unsigned, unsigned> images;
+
+    unsigned log_blocks() { return no_blocks - 1; }
+    // reads / writes count log blocks from position pos on, wrapping around
+    int transfer(bool write, unsigned pos, unsigned count, uint8_t *buf);
+    int write_header();
+    static uint64_t checksum(const uint8_t *data, size_t len);
+
+public:
+    Journal(BlockCache &cache) : cache(cache) {}
+    bool active() { return no_blocks != 0; }
+    // number of blocks format gives the journal of a volume of no_blocks
+    // blocks of block_size bytes
+    static unsigned blocks_for(unsigned no_blocks, unsigned block_size);
+    // starts an empty journal in the area of a new volume
+    int format(unsigned start, unsigned no_blocks);
+    // replays the records a crash left behind, then starts with an empty
+    // log. Returns the number of records replayed, -1 on error.
+    int attach(unsigned start, unsigned no_blocks);
+    // forgets the journal, e.g. before the block size changes
+    void detach();
+    // appends the dirty blocks of the cache that are not logged yet as one
+    // record. A batch too big for the log is written home directly.
+    int commit();
+    // writes every logged block home and empties the log
+    int checkpoint();
+};
+
+#endif // __JOURNAL_H__
@@ -0,0 +1,163 @@
+// journal_test checks that a crash loses no committed block. In a scratch
+// directory it commits changes to a few blocks through a small journal,
+// so the log wraps around many times, re-dirties each block right after
+// it is logged and checkpoints. It then drops the cache as a crash would,
+// replays the journal and compares every block with its last committed
+// contents, for each number of rounds up to JT_ROUNDS.
+//
+// It then removes a committed file and directory on a volume, writes a new
+// file that needs as many blocks as they took, crashes without a commit and
+// checks that both still hold their committed contents after the replay.
+//
+//     journal_test
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <vector>
+#include <unistd.h>
+#include "cache.h"
+#include "fs.h"
+#include "journal.h"
+
+#define JT_BLOCK_SIZE 4096
+#define JT_DISK_BLOCKS 64
+#define JT_JOURNAL_START 1
+#define JT_FIRST_BLOCK 32
+#define JT_NO_BLOCKS 5
+#define JT_ROUNDS 60
+// volume of the block reuse check, and the size of its files in blocks
+#define JT_VOLUME_BYTES (4 * 1024 * 1024)
+#define JT_FILE_BLOCKS 3
+
+// writes value into the first bytes of a block through the cache
+static int
+put(BlockCache &cache, unsigned block_no, uint64_t value)
+{
+    std::vector<uint8_t> blk(JT_BLOCK_SIZE, 0);
+    memcpy(blk.data(), &value, sizeof(value));
+    return cache.write(block_no, blk.data());
+}
+
+// runs rounds rounds, crashes and replays. False if a block lost its
+// committed contents.
+static bool
+run_rounds(Disk &disk, unsigned rounds)
+{
+    BlockCache cache(disk);
+    Journal journal(cache);
+    std::vector<uint8_t> zero(JT_BLOCK_SIZE, 0);
+    for (unsigned b = JT_FIRST_BLOCK; b < JT_FIRST_BLOCK + JT_NO_BLOCKS; b++)
+        disk.write(b, zero.data());
+    if (journal.format(JT_JOURNAL_START, JOURNAL_MIN_BLOCKS) != 0)
+        return false;
+
+    // block -> contents of its last commit, and the ones changed since
+    std::map<unsigned, uint64_t> committed;
+    std::map<unsigned, uint64_t> changed;
+    for (unsigned r = 1; r <= rounds; r++) {
+        unsigned b = JT_FIRST_BLOCK + r % JT_NO_BLOCKS;
+        if (put(cache, b, r) != 0)
+            return false;
+        changed[b] = r;
+        if (journal.commit() != 0)
+            return false;
+        for (auto &[block_no, value] : changed)
+            committed[block_no] = value;
+        changed.clear();
+        // the block just logged changes again, that is not committed before
+        // the crash
+        if (put(cache, b, 1000 + r) != 0)
+            return false;
+        changed[b] = 1000 + r;
+    }
+    if (journal.checkpoint() != 0)
+        return false;
+
+    // the crash: nothing the cache holds reaches the disk
+    cache.invalidate();
+    Journal replay(cache);
+    if (replay.attach(JT_JOURNAL_START, JOURNAL_MIN_BLOCKS) < 0)
+        return false;
+    std::vector<uint8_t> blk(JT_BLOCK_SIZE);
+    for (unsigned b = JT_FIRST_BLOCK; b < JT_FIRST_BLOCK + JT_NO_BLOCKS; b++) {
+        uint64_t value;
+        if (cache.read(b, blk.data()) != 0)
+            return false;
+        memcpy(&value, blk.data(), sizeof(value));
+        if (value != committed[b]) {
+            std::cerr << "[ERROR] journal_test: after " << rounds << " rounds block " << b << " holds " << value
+                      << " instead of " << committed[b] << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// fills a new file with count bytes of c, -1 on error
+static int
+write_file(FS &fs, const std::string &path, char c, uint32_t count)
+{
+    std::vector<uint8_t> data(count, (uint8_t)c);
+    int fd = fs.open(path, OPEN_WRITE | OPEN_CREATE);
+    if (fd < 0 || fs.write(fd, data.data(), count) != count)
+        return -1;
+    return fs.close(fd);
+}
+
+// removes a committed file and directory and writes a file as big as both
+// before a crash. False if the replayed volume lost either of them.
+static bool
+run_reuse()
+{
+    setenv("FS_DURABILITY", "none", 1);
+    // FS talks on cout, the check only reports its own findings
+    std::streambuf *out = std::cout.rdbuf(nullptr);
+    // the first FS is never destroyed, as a crash would leave it
+    FS *fs = new FS();
+    bool ok = fs->format(JT_VOLUME_BYTES, JT_BLOCK_SIZE) == 0 && fs->mkdir("/d") == 0 &&
+              write_file(*fs, "/a", 'A', JT_FILE_BLOCKS * JT_BLOCK_SIZE) == 0 && fs->sync() == 0 &&
+              fs->rm("/a") == 0 && fs->rm("/d") == 0 &&
+              write_file(*fs, "/b", 'B', (JT_FILE_BLOCKS + 1) * JT_BLOCK_SIZE) == 0;
+
+    FS replayed;
+    std::vector<uint8_t> data(JT_FILE_BLOCKS * JT_BLOCK_SIZE);
+    int fd = replayed.open("/a", OPEN_READ);
+    bool file_ok = fd >= 0 && replayed.read(fd, data.data(), (uint32_t)data.size()) == (int64_t)data.size() &&
+                   std::count(data.begin(), data.end(), 'A') == (long)data.size();
+    bool dir_ok = replayed.cd("/d") == 0 && replayed.cd("..") == 0;
+    std::cout.rdbuf(out);
+    if (!ok) {
+        std::cerr << "[ERROR] journal_test: could not set up the block reuse check\n";
+    } else if (!file_ok) {
+        std::cerr << "[ERROR] journal_test: a removed file lost its committed contents in the crash\n";
+    } else if (!dir_ok) {
+        std::cerr << "[ERROR] journal_test: a removed directory lost its committed contents in the crash\n";
+    }
+    return ok && file_ok && dir_ok;
+}
+
+int
+main()
+{
+    // the disk image is always diskfile.bin in the working directory
+    char dir[] = "/tmp/journal_testXXXXXX";
+    if (mkdtemp(dir) == nullptr || chdir(dir) != 0) {
+        std::cerr << "[ERROR] journal_test: can't make a scratch directory\n";
+        return 1;
+    }
+    bool ok = true;
+    {
+        Disk disk;
+        ok = disk.set_geometry(JT_BLOCK_SIZE, JT_DISK_BLOCKS) == 0;
+        for (unsigned rounds = 1; rounds <= JT_ROUNDS && ok; rounds++)
+            ok = run_rounds(disk, rounds);
+    }
+    ok = ok && run_reuse();
+    unlink(DISKNAME);
+    rmdir(dir);
+    std::cout << (ok ? "journal_test: OK\n" : "journal_test: FAILED\n");
+    return ok ? 0 : 1;
+}
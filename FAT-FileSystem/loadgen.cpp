@@ -0,0 +1,227 @@
+// loadgen drives a file system server (test_fs --serve) with several
+// clients. Each one keeps depth requests in flight on a file of its own,
+// reads and writes of bytes bytes at random block offsets. At the end it
+// prints the requests per second and the latency percentiles.
+//
+// With shared all clients work on one file and every write appends to it:
+// half of the clients write through PROTO_OPEN_APPEND descriptors, the others
+// append a file of their own with REQ_APPEND. The file must end up with
+// every byte that was appended successfully.
+//
+//     loadgen <socket> [clients] [seconds] [depth] [bytes] [write%] [shared]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "client.h"
+#include "stats.h"
+
+// the file of a client has this many blocks of bytes bytes
+#define LOAD_BLOCKS 256
+
+struct load_config {
+    std::string socket;
+    unsigned clients = 4;
+    unsigned seconds = 5;
+    unsigned depth = 16;
+    uint32_t bytes = 4096;
+    unsigned write_pct = 25;
+    bool shared = false;
+};
+
+struct load_result {
+    latency_histogram latency;
+    uint64_t errors = 0;
+    bool failed = false;
+    uint64_t appended = 0; // bytes appended to the shared file
+};
+
+// the file of a shared run
+static std::string
+shared_name()
+{
+    return "/loadgen" + std::to_string(getpid()) + "_shared";
+}
+
+static void
+run_client(const load_config &cfg, unsigned id, load_result &res)
+{
+    FsClient c;
+    std::string name = cfg.shared ? shared_name() : "/loadgen" + std::to_string(getpid()) + "_" + std::to_string(id);
+    int fd = -1;
+    uint32_t flags = PROTO_OPEN_READ | PROTO_OPEN_WRITE | (cfg.shared ? PROTO_OPEN_APPEND : PROTO_OPEN_CREATE);
+    if (c.connect(cfg.socket) != 0 || (fd = c.open(name, flags)) < 0) {
+        res.failed = true;
+        return;
+    }
+    std::vector<uint8_t> buf(cfg.bytes, (uint8_t)('a' + id % 26));
+    for (unsigned i = 0; i < LOAD_BLOCKS && !cfg.shared; i++) {
+        if (c.write(fd, buf.data(), cfg.bytes, (int64_t)i * cfg.bytes) != (int64_t)cfg.bytes) {
+            res.failed = true;
+            return;
+        }
+    }
+    // the odd clients of a shared run append a file of bytes bytes instead
+    // of writing
+    bool appends = cfg.shared && id % 2 == 1;
+    std::string source = name + "_" + std::to_string(id);
+    if (appends) {
+        int sfd = c.open(source, PROTO_OPEN_WRITE | PROTO_OPEN_CREATE);
+        if (sfd < 0 || c.write(sfd, buf.data(), cfg.bytes) != (int64_t)cfg.bytes || c.close(sfd) != 0) {
+            res.failed = true;
+            return;
+        }
+    }
+    uint32_t first_len = (uint32_t)source.size();
+    std::string paths = source + name;
+
+    std::mt19937 rng(id);
+    std::deque<std::chrono::steady_clock::time_point> started;
+    std::deque<bool> writes; // of the requests in flight
+    auto issue = [&] {
+        io_args io = { fd, cfg.bytes, (int64_t)(rng() % LOAD_BLOCKS) * cfg.bytes };
+        bool write = rng() % 100 < cfg.write_pct;
+        if (write && appends)
+            c.send(REQ_APPEND, &first_len, sizeof(first_len), paths.data(), paths.size());
+        else if (write)
+            c.send(REQ_WRITE, &io, sizeof(io), buf.data(), cfg.bytes);
+        else
+            c.send(REQ_READ, &io, sizeof(io));
+        started.push_back(std::chrono::steady_clock::now());
+        writes.push_back(write);
+    };
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(cfg.seconds);
+    for (unsigned i = 0; i < cfg.depth; i++)
+        issue();
+    // responses come in the order of the requests
+    while (!started.empty()) {
+        response_header h;
+        if (c.receive(h) != 0) {
+            res.failed = true;
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        res.latency.add((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - started.front()).count());
+        started.pop_front();
+        bool write = writes.front();
+        writes.pop_front();
+        // an append answers 0, reads and writes the bytes moved
+        if (h.result != ((write && appends) ? 0 : (int64_t)cfg.bytes))
+            res.errors++;
+        else if (write && cfg.shared)
+            res.appended += cfg.bytes;
+        if (now < deadline)
+            issue();
+    }
+    c.close(fd);
+    if (appends)
+        c.rm(source);
+    if (!cfg.shared)
+        c.rm(name);
+}
+
+// fills the file of a shared run with LOAD_BLOCKS blocks for the reads
+static int
+create_shared(const load_config &cfg)
+{
+    FsClient c;
+    std::vector<uint8_t> buf(cfg.bytes, '.');
+    int fd = -1;
+    if (c.connect(cfg.socket) != 0 || (fd = c.open(shared_name(), PROTO_OPEN_WRITE | PROTO_OPEN_CREATE)) < 0)
+        return -1;
+    for (unsigned i = 0; i < LOAD_BLOCKS; i++) {
+        if (c.write(fd, buf.data(), cfg.bytes) != (int64_t)cfg.bytes)
+            return -1;
+    }
+    return c.close(fd);
+}
+
+// size of the file of a shared run, which is removed, -1 on error
+static int64_t
+remove_shared(const load_config &cfg)
+{
+    FsClient c;
+    int fd = -1;
+    if (c.connect(cfg.socket) != 0 || (fd = c.open(shared_name(), PROTO_OPEN_READ)) < 0)
+        return -1;
+    int64_t size = c.seek(fd, 0, SEEK_END);
+    c.close(fd);
+    c.rm(shared_name());
+    return size;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 8) {
+        std::cerr << "Usage: loadgen <socket> [clients] [seconds] [depth] [bytes] [write%] [shared]\n";
+        return 1;
+    }
+    load_config cfg;
+    cfg.socket = argv[1];
+    if (argc > 2)
+        cfg.clients = (unsigned)atoi(argv[2]);
+    if (argc > 3)
+        cfg.seconds = (unsigned)atoi(argv[3]);
+    if (argc > 4)
+        cfg.depth = (unsigned)atoi(argv[4]);
+    if (argc > 5)
+        cfg.bytes = (uint32_t)atoi(argv[5]);
+    if (argc > 6)
+        cfg.write_pct = (unsigned)atoi(argv[6]);
+    if (argc > 7)
+        cfg.shared = std::string(argv[7]) == "shared";
+    if (cfg.clients == 0 || cfg.depth == 0 || cfg.bytes == 0 || cfg.bytes > PROTO_MAX_DATA || cfg.write_pct > 100) {
+        std::cerr << "[ERROR] clients, depth and bytes must be positive, bytes at most " << PROTO_MAX_DATA
+                  << " and write% at most 100\n";
+        return 1;
+    }
+
+    if (cfg.shared && create_shared(cfg) != 0) {
+        std::cerr << "[ERROR] could not create the shared file\n";
+        return 1;
+    }
+    std::vector<load_result> results(cfg.clients);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < cfg.clients; i++)
+        threads.emplace_back(run_client, std::cref(cfg), i, std::ref(results[i]));
+    for (std::thread &t : threads)
+        t.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    latency_histogram all;
+    uint64_t errors = 0;
+    unsigned failed = 0;
+    uint64_t appended = 0;
+    for (const load_result &r : results) {
+        all.merge(r.latency);
+        errors += r.errors;
+        failed += r.failed ? 1 : 0;
+        appended += r.appended;
+    }
+    printf("clients\tdepth\tbytes\trequests\treq/s\t\tp50 us\tp99 us\tp99.9 us\tmax us\terrors\n");
+    printf("%u\t%u\t%u\t%llu\t\t%.0f\t\t%llu\t%llu\t%llu\t\t%llu\t%llu\n", cfg.clients, cfg.depth, cfg.bytes,
+           (unsigned long long)all.count, all.count / secs, (unsigned long long)all.percentile(0.5),
+           (unsigned long long)all.percentile(0.99), (unsigned long long)all.percentile(0.999),
+           (unsigned long long)all.max_us, (unsigned long long)errors);
+    if (failed > 0) {
+        std::cerr << "[ERROR] " << failed << " of " << cfg.clients << " clients could not run\n";
+        return 1;
+    }
+    if (cfg.shared) {
+        uint64_t expected = (uint64_t)LOAD_BLOCKS * cfg.bytes + appended;
+        int64_t size = remove_shared(cfg);
+        printf("shared file: %lld bytes, %llu expected\n", (long long)size, (unsigned long long)expected);
+        if (size != (int64_t)expected) {
+            std::cerr << "[ERROR] the shared file lost appends\n";
+            return 1;
+        }
+    }
+    return 0;
+}
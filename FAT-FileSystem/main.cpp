@@ -1,10 +1,22 @@
+#include <cstdlib>
+#include <cstring>
 #include "shell.h"
 #include "fs.h"
 #include "disk.h"
+#include "server.h"
 
 int
 main(int argc, char **argv)
 {
+    // test_fs --serve <socket> [workers] serves the volume to clients
+    // instead of running the shell
+    if (argc >= 3 && argc <= 4 && strcmp(argv[1], "--serve") == 0) {
+        sigset_t mask;
+        Server::block_signals(&mask);
+        FS fs;
+        Server server(fs, argv[2], argc == 4 ? (unsigned)atoi(argv[3]) : SERVER_WORKERS);
+        return server.run() == 0 ? 0 : 1;
+    }
     Shell shell;
     shell.run();
     return 0;
@@ -0,0 +1,59 @@
+// protocol.h describes the binary protocol spoken between the file system
+// server (server.cpp) and its clients (client.cpp) over a Unix socket.
+#include <cstdint>
+
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+// Every message is a header followed by len bytes of payload. A client may
+// send any number of requests without waiting for their responses. The
+// server answers the requests of one connection in the order they came, and
+// each response carries the id of its request. Integers are in host byte
+// order, the socket is local. Paths are taken from the root directory.
+struct request_header {
+    uint32_t len; // bytes of payload after the header
+    uint32_t id; // chosen by the client, returned in the response
+    uint8_t op; // REQ_*
+    uint8_t pad[3];
+};
+
+struct response_header {
+    uint32_t len; // bytes of payload after the header
+    uint32_t id;
+    int64_t result; // what the FS call returned, -1 on error
+};
+
+// arguments of REQ_READ, REQ_WRITE and REQ_SEEK
+struct io_args {
+    int32_t fd;
+    uint32_t len; // READ: bytes wanted, WRITE: bytes that follow, SEEK: whence
+    int64_t offset; // READ / WRITE: -1 for the current position
+};
+
+// requests and their payloads
+#define REQ_PING 0 // nothing
+#define REQ_OPEN 1 // uint32_t PROTO_OPEN_* flags, then the path
+#define REQ_READ 2 // io_args; the response holds the data
+#define REQ_WRITE 3 // io_args, then the data
+#define REQ_SEEK 4 // io_args
+#define REQ_CLOSE 5 // io_args, only fd is used
+#define REQ_MKDIR 6 // the path
+#define REQ_RM 7 // the path
+#define REQ_CP 8 // uint32_t length of the first path, then both paths
+#define REQ_MV 9 // as REQ_CP
+#define REQ_APPEND 10 // as REQ_CP
+#define REQ_SYNC 11 // nothing
+#define REQ_COUNT 12
+
+// flags of REQ_OPEN, the server maps them to the FS ones
+#define PROTO_OPEN_READ 1
+#define PROTO_OPEN_WRITE 2
+#define PROTO_OPEN_CREATE 4 // creates the file if it does not exist
+#define PROTO_OPEN_APPEND 8 // every write goes to the end of the file
+
+// most data one READ or WRITE moves, and the largest payload either side
+// accepts
+#define PROTO_MAX_DATA (1024 * 1024)
+#define PROTO_MAX_PAYLOAD (PROTO_MAX_DATA + 4096)
+
+#endif // __PROTOCOL_H__
@@ -0,0 +1,400 @@
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.h"
+
+// sends all len bytes, false if the peer is gone
+static bool
+send_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = ::send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// the FS flags for the PROTO_OPEN_* flags of REQ_OPEN
+static int
+open_flags(uint32_t flags)
+{
+    return ((flags & PROTO_OPEN_READ) ? OPEN_READ : 0) | ((flags & PROTO_OPEN_WRITE) ? OPEN_WRITE : 0) |
+           ((flags & PROTO_OPEN_CREATE) ? OPEN_CREATE : 0) | ((flags & PROTO_OPEN_APPEND) ? OPEN_APPEND : 0);
+}
+
+// the two paths of REQ_CP, REQ_MV and REQ_APPEND
+static bool
+split_paths(const uint8_t *p, size_t len, std::string &first, std::string &second)
+{
+    uint32_t first_len;
+    if (len < sizeof(first_len))
+        return false;
+    memcpy(&first_len, p, sizeof(first_len));
+    if (first_len > len - sizeof(first_len))
+        return false;
+    const char *s = reinterpret_cast<const char*>(p + sizeof(first_len));
+    first.assign(s, first_len);
+    second.assign(s + first_len, len - sizeof(first_len) - first_len);
+    return true;
+}
+
+Server::Server(FS &fs, const std::string &path, unsigned no_workers)
+    : fs(fs), path(path), no_workers(no_workers == 0 ? 1 : no_workers)
+{
+}
+
+Server::~Server()
+{
+    stop();
+}
+
+void
+Server::block_signals(sigset_t *mask)
+{
+    sigemptyset(mask);
+    sigaddset(mask, SIGINT);
+    sigaddset(mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, mask, nullptr);
+}
+
+void
+Server::watch(int fd)
+{
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int
+Server::run()
+{
+    if (!fs.formatted()) {
+        std::cerr << "[ERROR] No file system on the disk, run format first\n";
+        return -1;
+    }
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "[ERROR] Invalid socket path '" << path << "'\n";
+        return -1;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    unlink(path.c_str());
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        listen(listen_fd, SOMAXCONN) != 0) {
+        std::cerr << "[ERROR] Could not listen on '" << path << "': " << strerror(errno) << "\n";
+        stop();
+        return -1;
+    }
+
+    sigset_t mask;
+    block_signals(&mask);
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    watch(listen_fd);
+    watch(signal_fd);
+    for (unsigned i = 0; i < no_workers; i++)
+        workers.emplace_back(&Server::worker, this);
+    std::cout << "Serving on " << path << " with " << no_workers << " workers\n" << std::flush;
+
+    std::vector<epoll_event> events(64);
+    bool running = true;
+    while (running) {
+        int n = epoll_wait(epoll_fd, events.data(), (int)events.size(), -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == signal_fd)
+                running = false;
+            else if (fd == listen_fd)
+                accept_all();
+            else
+                receive(fd);
+        }
+    }
+    stop();
+    return 0;
+}
+
+void
+Server::accept_all()
+{
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        auto c = std::make_shared<connection>();
+        c->fd = fd;
+        conns[fd] = c;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            live[fd] = c;
+        }
+        watch(fd);
+    }
+}
+
+// reads what the socket has and queues the whole requests in it
+void
+Server::receive(int fd)
+{
+    auto it = conns.find(fd);
+    if (it == conns.end())
+        return;
+    std::shared_ptr<connection> c = it->second;
+    bool gone = false;
+    uint8_t buf[64 * 1024];
+    while (true) {
+        ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0) {
+            c->in.insert(c->in.end(), buf, buf + n);
+            if ((size_t)n == sizeof(buf) && c->in.size() < SERVER_MAX_QUEUED)
+                continue;
+            break;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        gone = (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK));
+        break;
+    }
+
+    std::vector<std::vector<uint8_t>> whole;
+    size_t pos = 0;
+    while (c->in.size() - pos >= sizeof(request_header)) {
+        request_header h;
+        memcpy(&h, c->in.data() + pos, sizeof(h));
+        if (h.len > PROTO_MAX_PAYLOAD) {
+            // not a client of ours, the rest of its input is ignored
+            gone = true;
+            break;
+        }
+        if (c->in.size() - pos < sizeof(h) + h.len)
+            break;
+        whole.emplace_back(c->in.begin() + pos, c->in.begin() + pos + sizeof(h) + h.len);
+        pos += sizeof(h) + h.len;
+    }
+    c->in.erase(c->in.begin(), c->in.begin() + pos);
+
+    std::unique_lock<std::mutex> guard(lock);
+    for (auto &r : whole) {
+        c->queued_bytes += r.size();
+        c->requests.push_back(std::move(r));
+    }
+    if (gone) {
+        // the requests it sent before are still answered
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        conns.erase(fd);
+        c->closed = true;
+    } else if (c->queued_bytes >= SERVER_MAX_QUEUED) {
+        // the worker that answers them reads from it again
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        c->paused = true;
+    }
+    if (c->queued)
+        return;
+    if (!c->requests.empty()) {
+        c->queued = true;
+        ready.push_back(c);
+        ready_cv.notify_one();
+    } else if (c->closed) {
+        guard.unlock();
+        drop(*c);
+    }
+}
+
+void
+Server::worker()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        ready_cv.wait(guard, [this] { return stopping || !ready.empty(); });
+        if (stopping)
+            return;
+        std::shared_ptr<connection> c = ready.front();
+        ready.pop_front();
+        std::deque<std::vector<uint8_t>> batch;
+        batch.swap(c->requests);
+        c->queued_bytes = 0;
+        guard.unlock();
+
+        std::vector<uint8_t> out;
+        for (const auto &request : batch)
+            serve(*c, request, out);
+        // a peer that is gone is noticed by the loop
+        send_all(c->fd, out.data(), out.size());
+
+        guard.lock();
+        if (c->paused && c->requests.empty())
+            resume(*c);
+        if (!c->requests.empty()) {
+            // more came in meanwhile, the other connections go first
+            ready.push_back(c);
+            continue;
+        }
+        c->queued = false;
+        if (c->closed) {
+            guard.unlock();
+            drop(*c);
+            guard.lock();
+        }
+    }
+}
+
+void
+Server::serve(connection &c, const std::vector<uint8_t> &request, std::vector<uint8_t> &out)
+{
+    request_header h;
+    memcpy(&h, request.data(), sizeof(h));
+    const uint8_t *p = request.data() + sizeof(h);
+    size_t len = h.len;
+    size_t at = out.size();
+    out.resize(at + sizeof(response_header));
+
+    io_args io;
+    memset(&io, 0, sizeof(io));
+    if (len >= sizeof(io))
+        memcpy(&io, p, sizeof(io));
+    // a descriptor can only be used by the connection that opened it
+    bool owned = len >= sizeof(io) && c.fds.count(io.fd) != 0;
+    std::string first, second;
+    int64_t result = -1;
+    switch (h.op) {
+    case REQ_PING:
+        result = 0;
+        break;
+    case REQ_OPEN:
+        if (len >= sizeof(uint32_t)) {
+            uint32_t flags;
+            memcpy(&flags, p, sizeof(flags));
+            result = fs.open(std::string(reinterpret_cast<const char*>(p) + sizeof(flags), len - sizeof(flags)),
+                             open_flags(flags));
+            if (result != -1)
+                c.fds.insert((int)result);
+        }
+        break;
+    case REQ_READ:
+        if (owned && io.len <= PROTO_MAX_DATA && (io.offset < 0 || fs.seek(io.fd, io.offset, SEEK_SET) != -1)) {
+            out.resize(at + sizeof(response_header) + io.len);
+            result = fs.read(io.fd, out.data() + at + sizeof(response_header), io.len);
+            out.resize(at + sizeof(response_header) + (result > 0 ? (size_t)result : 0));
+        }
+        break;
+    case REQ_WRITE:
+        if (owned && (io.offset < 0 || fs.seek(io.fd, io.offset, SEEK_SET) != -1))
+            result = fs.write(io.fd, p + sizeof(io), (uint32_t)(len - sizeof(io)));
+        break;
+    case REQ_SEEK:
+        if (owned)
+            result = fs.seek(io.fd, io.offset, (int)io.len);
+        break;
+    case REQ_CLOSE:
+        // a descriptor close fails on stays open, as in FS
+        if (owned && (result = fs.close(io.fd)) == 0)
+            c.fds.erase(io.fd);
+        break;
+    case REQ_MKDIR:
+        result = fs.mkdir(std::string(reinterpret_cast<const char*>(p), len));
+        break;
+    case REQ_RM:
+        result = fs.rm(std::string(reinterpret_cast<const char*>(p), len));
+        break;
+    case REQ_CP:
+    case REQ_MV:
+    case REQ_APPEND:
+        if (split_paths(p, len, first, second)) {
+            result = (h.op == REQ_CP) ? fs.cp(first, second)
+                   : (h.op == REQ_MV) ? fs.mv(first, second) : fs.append(first, second);
+        }
+        break;
+    case REQ_SYNC:
+        result = fs.sync();
+        break;
+    }
+
+    response_header r = { (uint32_t)(out.size() - at - sizeof(r)), h.id, result };
+    memcpy(out.data() + at, &r, sizeof(r));
+}
+
+void
+Server::resume(connection &c)
+{
+    c.paused = false;
+    if (!c.closed && !stopping) {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = c.fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+}
+
+void
+Server::drop(connection &c)
+{
+    for (int fd : c.fds)
+        fs.close(fd);
+    c.fds.clear();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        live.erase(c.fd);
+    }
+    close(c.fd);
+}
+
+void
+Server::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        // a worker sending to a peer that does not read gives up
+        for (auto &[fd, c] : live)
+            shutdown(fd, SHUT_RDWR);
+    }
+    ready_cv.notify_all();
+    for (std::thread &t : workers)
+        t.join();
+    workers.clear();
+    // every connection left, whether the loop, the ready queue or a worker
+    // had it last
+    std::vector<std::shared_ptr<connection>> left;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &[fd, c] : live)
+            left.push_back(c);
+    }
+    for (auto &c : left)
+        drop(*c);
+    ready.clear();
+    conns.clear();
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(path.c_str());
+        listen_fd = -1;
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    if (signal_fd >= 0) {
+        close(signal_fd);
+        signal_fd = -1;
+    }
+}
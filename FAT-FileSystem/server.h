@@ -0,0 +1,86 @@
+// server.h is the header file for the Server class, which serves an FS to
+// many local clients over a Unix socket (protocol.h).
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <signal.h>
+#include "fs.h"
+#include "protocol.h"
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+// default number of worker threads
+#define SERVER_WORKERS 4
+// bytes of requests a connection may have waiting before the loop stops
+// reading from it until a worker has answered them
+#define SERVER_MAX_QUEUED (4 * 1024 * 1024)
+
+// One thread runs an epoll loop that accepts connections and cuts their
+// input into requests. A connection with requests waiting goes on the
+// ready queue, and a worker then answers everything it has received so
+// far with one send. A connection is served by one worker at a time, so
+// its responses keep the order of its requests. A client that sends faster
+// than it reads its responses is not read from while its requests wait.
+class Server {
+private:
+    FS &fs;
+    std::string path;
+    unsigned no_workers;
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int signal_fd = -1;
+
+    struct connection {
+        int fd;
+        std::vector<uint8_t> in; // received bytes that are no whole request yet
+        std::deque<std::vector<uint8_t>> requests; // whole requests, header included
+        size_t queued_bytes = 0; // in requests
+        bool queued = false; // on the ready queue or with a worker
+        bool closed = false; // the peer sent everything it will send
+        bool paused = false; // out of the epoll set, too many requests wait
+        std::set<int> fds; // FS descriptors it has open
+    };
+    // connections the loop reads from, by socket
+    std::unordered_map<int, std::shared_ptr<connection>> conns;
+    // every connection not dropped yet, by socket, so stop() finds those a
+    // worker holds too
+    std::unordered_map<int, std::shared_ptr<connection>> live;
+
+    // guards ready, stopping, live and the requests, queued_bytes, queued,
+    // closed and paused fields
+    std::mutex lock;
+    std::condition_variable ready_cv;
+    std::deque<std::shared_ptr<connection>> ready;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    void watch(int fd);
+    void accept_all();
+    void receive(int fd);
+    void worker();
+    // answers one request, appending the response to out
+    void serve(connection &c, const std::vector<uint8_t> &request, std::vector<uint8_t> &out);
+    // closes the descriptors and the socket of a connection nobody serves
+    void drop(connection &c);
+    // the loop reads from the connection again, called with lock held
+    void resume(connection &c);
+    void stop();
+
+public:
+    Server(FS &fs, const std::string &path, unsigned no_workers = SERVER_WORKERS);
+    ~Server();
+    // blocks SIGINT and SIGTERM, which end run(). Called before any thread
+    // starts, the FS included, so that no thread gets them instead.
+    static void block_signals(sigset_t *mask);
+    // serves until SIGINT or SIGTERM, -1 if the socket cannot be set up
+    int run();
+};
+
+#endif // __SERVER_H__
@@ -4,15 +4,60 @@
 #include <vector>
 #include "shell.h"
 #include "fs.h"
+#include "stress.h"
 
 std::string commands_str[] = {
     "format", "create", "cat", "ls",
     "cp", "mv", "rm", "append",
     "mkdir", "cd", "pwd",
-    "chmod",
-    "help", "quit", "clear"
+    "chmod", "sync", "stats", "df", "frag",
+    "stress", "help", "quit", "clear"
 };
 
+// parses a number of bytes such as 0, 4096, 64K, 512M or 20G (powers of
+// 1024), false if invalid or too large for 64 bits
+static bool
+parse_bytes(const std::string &str, uint64_t &value)
+{
+    size_t pos = 0;
+    if (str.empty() || str[0] == '-')
+        return false;
+    try {
+        value = std::stoull(str, &pos);
+    } catch (const std::out_of_range &) {
+        std::cout << "Error: " << str << " is too large\n";
+        return false;
+    } catch (...) {
+        return false;
+    }
+    std::string suffix = str.substr(pos);
+    unsigned shift = 0;
+    if (suffix == "K" || suffix == "k")
+        shift = 10;
+    else if (suffix == "M" || suffix == "m")
+        shift = 20;
+    else if (suffix == "G" || suffix == "g")
+        shift = 30;
+    else if (suffix == "T" || suffix == "t")
+        shift = 40;
+    else if (!suffix.empty())
+        return false;
+    if (value > (UINT64_MAX >> shift)) {
+        std::cout << "Error: " << str << " is too large\n";
+        return false;
+    }
+    value <<= shift;
+    return true;
+}
+
+// parses a size such as 4096, 64K, 512M or 20G (powers of 1024), 0 if invalid
+static uint64_t
+parse_size(const std::string &str)
+{
+    uint64_t value;
+    return parse_bytes(str, value) ? value : 0;
+}
+
 Shell::Shell()
 {
     //std::cout << "Starting shell...\n";
@@ -65,13 +110,33 @@ Shell::run()
                 std::cout << "cmd/arg: " << cmd_line[i] << "\n";
         }
 
+        if (cmd != "format" && cmd != "help" && cmd != "quit" && cmd != "clear" && cmd != "" &&
+            !filesystem.formatted()) {
+            std::cout << "Error: no file system on the disk, run format first\n";
+            continue;
+        }
+
         if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
+            uint64_t volume_size = 0;
+            uint64_t block_size = 0;
+            if (cmd_line.size() >= 2) {
+                volume_size = parse_size(cmd_line[1]);
+            }
+            if (cmd_line.size() == 3) {
+                block_size = parse_size(cmd_line[2]);
+            }
+            if (cmd_line.size() > 3 || (cmd_line.size() >= 2 && volume_size == 0) ||
+                (cmd_line.size() == 3 && (block_size == 0 || block_size > UINT32_MAX))) {
+                std::cout << "Usage: format [size] [blocksize], e.g. format 64M 64K\n";
+                continue;
+            }
+            if (volume_size > (uint64_t)INT32_MAX * MAX_BLOCK_SIZE) {
+                std::cout << "Error: a volume can be at most " << ((uint64_t)INT32_MAX * MAX_BLOCK_SIZE >> 40)
+                          << "T\n";
                 continue;
             }
             // check return value so everything is ok
-            ret_val = filesystem.format();
+            ret_val = filesystem.format(volume_size, (uint32_t)block_size);
             if (ret_val) {
                 std::cout << "Error: format failed, error code " << ret_val << std::endl;
             }
@@ -93,13 +158,16 @@ Shell::run()
         }
 
         else if (cmd == "cat") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cat <file>\n";
+            uint64_t offset = 0;
+            uint64_t len = UINT64_MAX;
+            if ((cmd_line.size() != 2 && cmd_line.size() != 4) ||
+                (cmd_line.size() == 4 && (!parse_bytes(cmd_line[2], offset) || !parse_bytes(cmd_line[3], len)))) {
+                std::cout << "Usage: cat <file> [offset len], e.g. cat log 1M 4K\n";
                 continue;
             }
             arg1 = cmd_line[1];
             // check return value so everything is ok
-            ret_val = filesystem.cat(arg1);
+            ret_val = filesystem.cat(arg1, offset, len);
             if (ret_val) {
                 std::cout << "Error: cat " << arg1;
                 std::cout << " failed, error code " << ret_val << std::endl;
@@ -232,6 +300,70 @@ Shell::run()
             }
         }
 
+        else if (cmd == "sync") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: sync\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.sync();
+            if (ret_val) {
+                std::cout << "Error: sync failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "df") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: df\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.df();
+            if (ret_val) {
+                std::cout << "Error: df failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "frag") {
+            if (cmd_line.size() > 2) {
+                std::cout << "Usage: frag [file]\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.frag(cmd_line.size() == 2 ? cmd_line[1] : "");
+            if (ret_val) {
+                std::cout << "Error: frag failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "stats") {
+            if (cmd_line.size() > 2) {
+                std::cout << "Usage: stats [json|reset]\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.stats(cmd_line.size() == 2 ? cmd_line[1] : "");
+            if (ret_val) {
+                std::cout << "Error: stats failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "stress") {
+            uint64_t threads = 8;
+            uint64_t files = 200;
+            if (cmd_line.size() > 3 ||
+                (cmd_line.size() >= 2 && (!parse_bytes(cmd_line[1], threads) || threads == 0 || threads > 256)) ||
+                (cmd_line.size() == 3 && (!parse_bytes(cmd_line[2], files) || files == 0 || files > UINT32_MAX))) {
+                std::cout << "Usage: stress [threads] [files], e.g. stress 8 200\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = run_stress(filesystem, (unsigned)threads, (unsigned)files);
+            if (ret_val) {
+                std::cout << "Error: stress failed, error code " << ret_val << std::endl;
+            }
+        }
+
         else if (cmd == "clear") {
             system("clear");
         }
@@ -241,7 +373,7 @@ Shell::run()
 
         else if (cmd == "help") {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, clear, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, sync, stats, df, frag, stress, help, clear, quit\n";
         }
 
         else if (cmd == "") {
@@ -250,7 +382,7 @@ Shell::run()
 
         else {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, clear, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, sync, stats, df, frag, stress, help, clear, quit\n";
         }
     }
 }
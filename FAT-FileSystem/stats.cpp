@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <iomanip>
+#include "stats.h"
+
+const char *block_type_names[BT_COUNT] = { "super", "root", "fat", "dir", "data", "journal" };
+const char *op_names[OP_COUNT] = { "create", "cat", "cp", "mv", "rm", "append" };
+
+void
+latency_histogram::add(uint64_t us)
+{
+    unsigned bucket = 0;
+    while (bucket < HIST_BUCKETS - 1 && (us >> bucket) != 0)
+        bucket++;
+    buckets[bucket]++;
+    count++;
+    total_us += us;
+    if (us > max_us)
+        max_us = us;
+}
+
+// adds the samples of another histogram
+void
+latency_histogram::merge(const latency_histogram &other)
+{
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+        buckets[i] += other.buckets[i];
+    count += other.count;
+    total_us += other.total_us;
+    max_us = std::max(max_us, other.max_us);
+}
+
+// upper bound of the bucket holding the p-th fraction of the samples
+uint64_t
+latency_histogram::percentile(double p) const
+{
+    if (count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(p * (count - 1)) + 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return std::min((uint64_t)1 << i, max_us);
+    }
+    return max_us;
+}
+
+// prints all counters as a table
+void
+print_stats(std::ostream &out, const io_stats &io, const cache_stats &cache,
+            const latency_histogram *ops)
+{
+    out << std::left << std::setw(8) << "block" << std::right << std::setw(14) << "read"
+        << std::setw(14) << "written" << "\n";
+    for (int t = 0; t < BT_COUNT; t++) {
+        out << std::left << std::setw(8) << block_type_names[t] << std::right
+            << std::setw(14) << io.blocks_read[t] << std::setw(14) << io.blocks_written[t] << "\n";
+    }
+    out << "disk: " << io.read_calls << " reads (" << io.bytes_read << " bytes), "
+        << io.write_calls << " writes (" << io.bytes_written << " bytes), "
+        << io.flushes << " flushes\n";
+    out << "cache: " << cache.hits << " hits, " << cache.misses << " misses, "
+        << cache.evictions << " evictions, " << cache.writebacks << " writebacks\n";
+
+    out << std::left << std::setw(8) << "op" << std::right << std::setw(10) << "count"
+        << std::setw(12) << "avg us" << std::setw(12) << "p50 us" << std::setw(12) << "p99 us"
+        << std::setw(12) << "max us" << "\n";
+    for (int o = 0; o < OP_COUNT; o++) {
+        const latency_histogram &h = ops[o];
+        out << std::left << std::setw(8) << op_names[o] << std::right << std::setw(10) << h.count
+            << std::setw(12) << (h.count ? h.total_us / h.count : 0)
+            << std::setw(12) << h.percentile(0.5) << std::setw(12) << h.percentile(0.99)
+            << std::setw(12) << h.max_us << "\n";
+    }
+}
+
+// prints all counters as one JSON object on a single line
+void
+print_stats_json(std::ostream &out, const io_stats &io, const cache_stats &cache,
+                 const latency_histogram *ops)
+{
+    out << "{\"blocks\":{";
+    for (int t = 0; t < BT_COUNT; t++) {
+        out << (t ? "," : "") << "\"" << block_type_names[t] << "\":{\"read\":"
+            << io.blocks_read[t] << ",\"written\":" << io.blocks_written[t] << "}";
+    }
+    out << "},\"disk\":{\"read_calls\":" << io.read_calls << ",\"write_calls\":" << io.write_calls
+        << ",\"bytes_read\":" << io.bytes_read << ",\"bytes_written\":" << io.bytes_written
+        << ",\"flushes\":" << io.flushes << "}";
+    out << ",\"cache\":{\"hits\":" << cache.hits << ",\"misses\":" << cache.misses
+        << ",\"evictions\":" << cache.evictions << ",\"writebacks\":" << cache.writebacks << "}";
+    out << ",\"ops\":{";
+    for (int o = 0; o < OP_COUNT; o++) {
+        const latency_histogram &h = ops[o];
+        out << (o ? "," : "") << "\"" << op_names[o] << "\":{\"count\":" << h.count
+            << ",\"total_us\":" << h.total_us << ",\"max_us\":" << h.max_us << ",\"buckets\":[";
+        // trailing empty buckets are left out
+        int last = HIST_BUCKETS - 1;
+        while (last >= 0 && h.buckets[last] == 0)
+            last--;
+        for (int i = 0; i <= last; i++)
+            out << (i ? "," : "") << h.buckets[i];
+        out << "]}";
+    }
+    out << "}}\n";
+}
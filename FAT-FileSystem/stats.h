@@ -0,0 +1,71 @@
+// stats.h holds the counters kept by Disk, BlockCache and FS. They are
+// always on and cost an increment per event, `stats` in the shell prints them.
+#include <cstdint>
+#include <ostream>
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+// block types, by where the block lives in the volume
+#define BT_SUPER 0
+#define BT_ROOT 1
+#define BT_FAT 2
+#define BT_DIR 3
+#define BT_DATA 4
+#define BT_JOURNAL 5
+#define BT_COUNT 6
+
+extern const char *block_type_names[BT_COUNT];
+
+struct io_stats {
+    uint64_t blocks_read[BT_COUNT] = {0};
+    uint64_t blocks_written[BT_COUNT] = {0};
+    uint64_t read_calls = 0; // disk calls, a run or an async request is one
+    uint64_t write_calls = 0;
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+    uint64_t flushes = 0;
+};
+
+struct cache_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t writebacks = 0; // dirty blocks written on eviction or sync
+};
+
+// operations with a latency histogram
+#define OP_CREATE 0
+#define OP_CAT 1
+#define OP_CP 2
+#define OP_MV 3
+#define OP_RM 4
+#define OP_APPEND 5
+#define OP_COUNT 6
+
+extern const char *op_names[OP_COUNT];
+
+// bucket i counts latencies below 2^i microseconds (and at least 2^(i-1)),
+// the last bucket everything longer
+#define HIST_BUCKETS 32
+
+struct latency_histogram {
+    uint64_t count = 0;
+    uint64_t total_us = 0;
+    uint64_t max_us = 0;
+    uint64_t buckets[HIST_BUCKETS] = {0};
+
+    void add(uint64_t us);
+    // adds the samples of another histogram
+    void merge(const latency_histogram &other);
+    // upper bound of the bucket holding the p-th fraction of the samples
+    uint64_t percentile(double p) const;
+};
+
+// prints all counters as a table, or as one JSON object
+void print_stats(std::ostream &out, const io_stats &io, const cache_stats &cache,
+                 const latency_histogram *ops);
+void print_stats_json(std::ostream &out, const io_stats &io, const cache_stats &cache,
+                      const latency_histogram *ops);
+
+#endif // __STATS_H__
@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "stress.h"
+
+// the share of one thread, false on the first error
+static bool
+stress_thread(FS &fs, const std::string &dir, unsigned files, unsigned seed)
+{
+    if (fs.mkdir(dir) != 0 || fs.cd(dir) != 0)
+        return false;
+    std::vector<uint8_t> data(STRESS_FILE_BYTES);
+    std::vector<uint8_t> back(STRESS_FILE_BYTES);
+    bool ok = true;
+    for (unsigned i = 0; i < files && ok; i++) {
+        // the names are relative, they resolve in this thread's directory
+        std::string name = "f" + std::to_string(i);
+        for (size_t k = 0; k < data.size(); k++)
+            data[k] = (uint8_t)(seed * 31 + i + k);
+        int fd = fs.open(name, OPEN_WRITE | OPEN_CREATE);
+        ok = fd != -1 && fs.write(fd, data.data(), (uint32_t)data.size()) == (int64_t)data.size();
+        if (fd != -1 && fs.close(fd) != 0)
+            ok = false;
+        fd = ok ? fs.open(name, OPEN_READ) : -1;
+        ok = fd != -1 && fs.read(fd, back.data(), (uint32_t)back.size()) == (int64_t)back.size() && back == data;
+        if (fd != -1)
+            fs.close(fd);
+        ok = ok && fs.rm(name) == 0;
+    }
+    return fs.cd("/") == 0 && fs.rm(dir) == 0 && ok;
+}
+
+// the appends of one thread to the shared file, each of the byte 'a' + t
+static bool
+append_thread(FS &fs, unsigned t, unsigned appends)
+{
+    std::vector<uint8_t> data(STRESS_APPEND_BYTES, (uint8_t)('a' + t % 26));
+    if (t % 2 == 0) {
+        int fd = fs.open(STRESS_SHARED, OPEN_WRITE | OPEN_APPEND);
+        bool ok = fd != -1;
+        for (unsigned i = 0; i < appends && ok; i++)
+            ok = fs.write(fd, data.data(), (uint32_t)data.size()) == (int64_t)data.size();
+        if (fd != -1 && fs.close(fd) != 0)
+            ok = false;
+        return ok;
+    }
+    // the others append a file of their own with the append command
+    std::string source = STRESS_SHARED + std::to_string(t);
+    int fd = fs.open(source, OPEN_WRITE | OPEN_CREATE);
+    bool ok = fd != -1 && fs.write(fd, data.data(), (uint32_t)data.size()) == (int64_t)data.size();
+    if (fd != -1 && fs.close(fd) != 0)
+        ok = false;
+    for (unsigned i = 0; i < appends && ok; i++)
+        ok = fs.append(source, STRESS_SHARED) == 0;
+    return fs.rm(source) == 0 && ok;
+}
+
+// n threads append to one file that starts with STRESS_APPEND_BYTES / 16
+// bytes, false if it does not end up with every byte of every append
+static bool
+shared_appends(FS &fs, unsigned n, unsigned appends)
+{
+    std::vector<uint8_t> head(STRESS_APPEND_BYTES / 16, '.');
+    int fd = fs.open(STRESS_SHARED, OPEN_WRITE | OPEN_CREATE);
+    bool ok = fd != -1 && fs.write(fd, head.data(), (uint32_t)head.size()) == (int64_t)head.size();
+    if (fd != -1 && fs.close(fd) != 0)
+        ok = false;
+    if (!ok)
+        return false;
+
+    std::atomic<unsigned> failed{0};
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < n; t++) {
+        threads.emplace_back([&fs, &failed, t, appends] {
+            if (!append_thread(fs, t, appends))
+                failed++;
+        });
+    }
+    for (std::thread &t : threads)
+        t.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "appends/s to one file on " << n << " threads: " << (uint64_t)(n * appends / secs) << "\n";
+
+    // every byte value must occur as often as it was appended
+    uint64_t expected = head.size() + (uint64_t)n * appends * STRESS_APPEND_BYTES;
+    std::vector<uint64_t> count(256, 0);
+    std::vector<uint8_t> buf(STRESS_FILE_BYTES);
+    uint64_t size = 0;
+    int64_t got = 0;
+    fd = fs.open(STRESS_SHARED, OPEN_READ);
+    while (fd != -1 && (got = fs.read(fd, buf.data(), (uint32_t)buf.size())) > 0) {
+        for (int64_t i = 0; i < got; i++)
+            count[buf[i]]++;
+        size += (uint64_t)got;
+    }
+    ok = fd != -1 && got == 0 && failed == 0 && size == expected && count['.'] == head.size();
+    for (unsigned t = 0; t < n && t < 26; t++)
+        ok = ok && count['a' + t] == (uint64_t)((n - 1 - t) / 26 + 1) * appends * STRESS_APPEND_BYTES;
+    if (fd != -1)
+        fs.close(fd);
+    if (size != expected)
+        std::cerr << "[ERROR] stress: the shared file has " << size << " bytes instead of " << expected << ".\n";
+    return fs.rm(STRESS_SHARED) == 0 && ok;
+}
+
+int
+run_stress(FS &fs, unsigned max_threads, unsigned files)
+{
+    int ret = 0;
+    double base = 0;
+    std::cout << "threads\t\tfiles/s\t\tspeedup\n";
+    // 1, 2, 4 ... threads, and max_threads last
+    for (unsigned n = 1;; n = std::min(n * 2, max_threads)) {
+        std::atomic<unsigned> failed{0};
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned t = 0; t < n; t++) {
+            threads.emplace_back([&fs, &failed, files, t] {
+                if (!stress_thread(fs, "/stress" + std::to_string(t), files, t))
+                    failed++;
+            });
+        }
+        for (std::thread &t : threads)
+            t.join();
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double rate = n * files / secs;
+        if (n == 1)
+            base = rate;
+        char speedup[16];
+        snprintf(speedup, sizeof(speedup), "%.2f", rate / base);
+        std::cout << n << "\t\t" << (uint64_t)rate << "\t\t" << speedup << "\n";
+        if (failed > 0) {
+            std::cerr << "[ERROR] stress: " << failed << " of " << n << " threads failed.\n";
+            ret = -1;
+        }
+        if (n >= max_threads)
+            break;
+    }
+    if (!shared_appends(fs, max_threads, files)) {
+        std::cerr << "[ERROR] stress: appends to a shared file went wrong.\n";
+        ret = -1;
+    }
+    return ret;
+}
@@ -0,0 +1,23 @@
+// stress.h runs one file workload on 1, 2, 4 ... threads that share an FS,
+// to show how its throughput grows with the number of threads.
+#include "fs.h"
+
+#ifndef __STRESS_H__
+#define __STRESS_H__
+
+// bytes each file of the workload gets
+#define STRESS_FILE_BYTES (64 * 1024)
+// the file all threads append to at the end, and the bytes of each append
+#define STRESS_SHARED "/stress_shared"
+#define STRESS_APPEND_BYTES 5000
+
+// Every thread makes a directory of its own and cds into it, then creates
+// files files there through the handle API, reads each one back and
+// removes it. Prints the files per second for each thread count. Then
+// max_threads threads append files times to one shared file, half of them
+// through OPEN_APPEND descriptors and half with append, and its final size
+// and contents are checked. Returns -1 if a thread ran into an error or
+// the shared file lost an append.
+int run_stress(FS &fs, unsigned max_threads, unsigned files);
+
+#endif // __STRESS_H__